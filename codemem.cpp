@@ -0,0 +1,101 @@
+#include "codemem.h"
+#include "specializer.h"
+#include "llvm/Object/ObjectFile.h"
+#include <cstring>
+#include <map>
+#include <mutex>
+
+using namespace llvm;
+using namespace std;
+
+// Read-only data sections of every finalized object, by start address, with their end.
+static mutex immutable_lock;
+static map<uint64_t, uint64_t> immutable;
+
+CodeMemoryManager::CodeMemoryManager(): memory(make_unique<SectionMemoryManager>()) {}
+
+CodeMemoryManager::~CodeMemoryManager() {
+    forgetReadOnly();
+}
+
+uint8_t* CodeMemoryManager::allocateCodeSection(uintptr_t size, unsigned alignment, unsigned id, StringRef name) {
+    bytes += size;
+    return memory->allocateCodeSection(size, alignment, id, name);
+}
+
+uint8_t* CodeMemoryManager::allocateDataSection(uintptr_t size, unsigned alignment, unsigned id, StringRef name, bool readonly) {
+    bytes += size;
+    uint8_t* addr = memory->allocateDataSection(size, alignment, id, name, readonly);
+    if (addr && readonly && size) readonly_sections.push_back({ (uint64_t)addr, (uint64_t)addr + size });
+    return addr;
+}
+
+bool CodeMemoryManager::needsToReserveAllocationSpace() {
+    return memory->needsToReserveAllocationSpace();
+}
+
+void CodeMemoryManager::reserveAllocationSpace(uintptr_t code_size, uint32_t code_align, uintptr_t ro_size, uint32_t ro_align,
+                                               uintptr_t rw_size, uint32_t rw_align) {
+    memory->reserveAllocationSpace(code_size, code_align, ro_size, ro_align, rw_size, rw_align);
+}
+
+void CodeMemoryManager::registerEHFrames(uint8_t* addr, uint64_t load_addr, size_t size) {
+    memory->registerEHFrames(addr, load_addr, size);
+}
+
+// The object layer deregisters every object's frames when it is destroyed, including released ones.
+void CodeMemoryManager::deregisterEHFrames() {
+    if (memory) memory->deregisterEHFrames();
+}
+
+// Read-only sections may still be written while relocations are applied, so they are only published
+// once the object is finalized.
+bool CodeMemoryManager::finalizeMemory(string* err) {
+    if (memory->finalizeMemory(err)) return true;
+    lock_guard<mutex> lock(immutable_lock);
+    for (auto& section : readonly_sections) immutable[section.first] = section.second;
+    return false;
+}
+
+void CodeMemoryManager::forgetReadOnly() {
+    lock_guard<mutex> lock(immutable_lock);
+    for (auto& section : readonly_sections) immutable.erase(section.first);
+    readonly_sections.clear();
+}
+
+bool ReadImmutable(uint64_t addr, uint64_t size, void* out) {
+    lock_guard<mutex> lock(immutable_lock);
+    auto it = immutable.upper_bound(addr);
+    if (it == immutable.begin()) return false;
+    -- it;
+    if (addr + size < addr || addr + size > it->second) return false;
+    memcpy(out, (const void*)addr, size);
+    return true;
+}
+
+void CodeMemoryManager::notifyObjectLoaded(RuntimeDyld& dyld, const object::ObjectFile& obj) {
+    for (const auto& sym : obj.symbols()) {
+        auto flags = sym.getFlags();
+        if (!flags || (*flags & object::SymbolRef::SF_Undefined) || !(*flags & object::SymbolRef::SF_Global)) {
+            if (!flags) consumeError(flags.takeError());
+            continue;
+        }
+        auto name = sym.getName();
+        if (!name) {
+            consumeError(name.takeError());
+            continue;
+        }
+        TrackCodeMemory(*name, this);
+    }
+}
+
+uint64_t CodeMemoryManager::size() const {
+    return bytes;
+}
+
+void CodeMemoryManager::release() {
+    if (!memory) return;
+    forgetReadOnly();
+    memory->deregisterEHFrames();
+    memory.reset();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Memory manager for a single linked object. Forwards to a SectionMemoryManager while counting the
+// bytes allocated for the object's sections, so the specializer can account for the code memory
+// each specialization takes up. The object layer keeps its memory managers until the JIT is
+// destroyed; release lets the specializer free an evicted specialization's memory before then.
+class CodeMemoryManager : public llvm::RuntimeDyld::MemoryManager {
+    std::unique_ptr<llvm::SectionMemoryManager> memory;
+    std::atomic<uint64_t> bytes{0};
+    std::vector<std::pair<uint64_t, uint64_t>> readonly_sections; // read-only data sections, as (start, end)
+
+    void forgetReadOnly();
+public:
+    CodeMemoryManager();
+    ~CodeMemoryManager();
+
+    uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment, unsigned id, llvm::StringRef name) override;
+    uint8_t* allocateDataSection(uintptr_t size, unsigned alignment, unsigned id, llvm::StringRef name, bool readonly) override;
+    bool needsToReserveAllocationSpace() override;
+    void reserveAllocationSpace(uintptr_t code_size, uint32_t code_align, uintptr_t ro_size, uint32_t ro_align,
+                                uintptr_t rw_size, uint32_t rw_align) override;
+    void registerEHFrames(uint8_t* addr, uint64_t load_addr, size_t size) override;
+    void deregisterEHFrames() override;
+    bool finalizeMemory(std::string* err) override;
+
+    // Offers the object's symbols to the specializer, which claims the objects holding specializations.
+    void notifyObjectLoaded(llvm::RuntimeDyld& dyld, const llvm::object::ObjectFile& obj) override;
+
+    // Returns the number of bytes allocated for the object.
+    uint64_t size() const;
+
+    // Frees the object's memory. The caller must ensure no code in the object can run again.
+    void release();
+};
+
+// Copies size bytes at addr into out, if they all lie in one read-only data section of a finalized
+// object, and returns true. Such memory never changes for as long as the object is loaded, so its
+// contents can be folded into code that is only run with pointers into it.
+bool ReadImmutable(uint64_t addr, uint64_t size, void* out);
@@ -1,4 +1,9 @@
 #include "hash.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 intmap::bucket::bucket(): status(EMPTY) {
 	//
@@ -11,10 +16,6 @@ inline void intmap::bucket::fill(uint64_t key_in, uint64_t value_in) {
 	key = key_in, value = value_in;
 }
 
-inline void intmap::bucket::evict() {
-	status = GHOST;
-}
-
 inline void intmap::bucket::clear() {
 	status = EMPTY;
 }
@@ -42,15 +43,37 @@ void intmap::copy(const bucket* bs) {
 }
 
 void intmap::grow() {
+	rehash(_capacity * 4);
+}
+
+void intmap::rehash(uint32_t size) {
 	bucket* old = data;
 	uint32_t oldsize = _capacity;
-	init(_capacity * 4);
+	init(size);
 	for (uint32_t i = 0; i < oldsize; ++ i) {
 		if (old[i].status == FILLED) emplace(old[i].key, old[i].value);
 	}
 	delete[] old;
 }
 
+// Returns the bucket holding k, or the capacity if there is none.
+uint32_t intmap::locate(uint64_t k) const {
+	uint64_t h = hash(k);
+	uint64_t i = h & _mask;
+	while (true) {
+		if (data[i].status == EMPTY) return _capacity;
+		uint64_t dist = (i - h) & _mask;
+		if (distance(i) < dist) return _capacity;
+		if (data[i].key == k) return i;
+		i = (i + 1) & _mask;
+	}
+}
+
+// Distance of a filled bucket from its entry's home bucket.
+inline uint32_t intmap::distance(uint32_t i) const {
+	return (i - (hash(data[i].key) & _mask)) & _mask;
+}
+
 inline uint64_t intmap::hash(uint64_t k) const {
 	k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ul;
     k = (k ^ (k >> 27)) * 0x94d049bb133111ebul;
@@ -128,25 +151,19 @@ void intmap::emplace(uint64_t k, uint64_t v) {
 	uint64_t i = h & _mask;
 	uint64_t key = k, value = v;
 	while (true) {
-		if (data[i].status == EMPTY || data[i].status == GHOST) {
+		if (data[i].status == EMPTY) {
 			data[i].fill(key, value);
 			++ _size;
 			return;
 		}
 
-		if (data[i].status == FILLED && data[i].key == key) {
+		if (data[i].key == key) {
 			data[i].value = value;
 			return;
 		}
 
-		uint64_t other_dist = (i - (hash(data[i].key) & _mask)) & _mask;
+		uint64_t other_dist = distance(i);
 		if (other_dist < dist) {
-			if (data[i].status == GHOST) {
-				data[i].fill(key, value);
-				++ _size;
-				return;
-			}
-
 			uint64_t tk = data[i].key, tv = data[i].value;
 			data[i].key = key, data[i].value = value;
 			key = tk, value = tv;
@@ -157,40 +174,317 @@ void intmap::emplace(uint64_t k, uint64_t v) {
 	}
 }
 
+// Removes k and shifts each following entry back one bucket, until reaching an empty bucket or
+// an entry already in its home bucket. Invalidates iterators.
 void intmap::erase(uint64_t k) {
+	uint32_t i = locate(k);
+	if (i == _capacity) return;
+	uint32_t j = (i + 1) & _mask;
+	while (data[j].status == FILLED && distance(j) > 0) {
+		data[i] = data[j];
+		i = j;
+		j = (j + 1) & _mask;
+	}
+	data[i].clear();
+	-- _size;
+	if (_capacity > 8 && _size < _capacity / 8) rehash(_capacity / 4 < 8 ? 8 : _capacity / 4);
+}
+
+intmap::const_iterator intmap::find(uint64_t k) const {
+	uint32_t i = locate(k);
+	if (i == _capacity) return end();
+	return const_iterator(data + i, data + _capacity);
+}
+
+uint32_t intmap::size() const {
+	return _size;
+}
+
+uint32_t intmap::capacity() const {
+	return _capacity;
+}
+
+void intmap::reserve(uint32_t n) {
+	uint32_t size = _capacity;
+	while (n > size * 5 / 8) size *= 2;
+	if (size != _capacity) rehash(size);
+}
+
+void intmap::shrink_to_fit() {
+	uint32_t size = 8;
+	while (_size > size * 5 / 8) size *= 2;
+	if (size != _capacity) rehash(size);
+}
+
+uint32_t intmap::max_probe_length() const {
+	uint32_t longest = 0;
+	for (uint32_t i = 0; i < _capacity; ++ i) {
+		if (data[i].status == FILLED && distance(i) + 1 > longest) longest = distance(i) + 1;
+	}
+	return longest;
+}
+
+double intmap::average_probe_length() const {
+	if (!_size) return 0;
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < _capacity; ++ i) {
+		if (data[i].status == FILLED) total += distance(i) + 1;
+	}
+	return (double)total / _size;
+}
+
+
+// Bitmasks of the slots in a group whose control byte equals some value. The control bytes are loaded
+// all at once without synchronization, so a match is only a hint; the slot's byte is reloaded with
+// acquire ordering before its key is read.
+struct group_bits {
+#ifdef __SSE2__
+	__m128i ctrl;
+
+	group_bits(const void* g): ctrl(_mm_load_si128((const __m128i*)g)) {}
+
+	uint32_t match(uint8_t b) const {
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+	}
+#else
+	uint8_t ctrl[16];
+
+	group_bits(const void* g) {
+		for (uint32_t i = 0; i < 16; ++ i) ctrl[i] = ((const volatile uint8_t*)g)[i];
+	}
+
+	uint32_t match(uint8_t b) const {
+		uint32_t bits = 0;
+		for (uint32_t i = 0; i < 16; ++ i) bits |= (uint32_t)(ctrl[i] == b) << i;
+		return bits;
+	}
+#endif
+};
+
+concurrent_intmap::table::table(uint32_t size): capacity(size), groups(size / GROUP), used(0), next(nullptr) {
+	ctrl = new group[groups];
+	keys = new uint64_t[size];
+	values = new std::atomic<uint64_t>[size];
+	for (uint32_t i = 0; i < size; ++ i) {
+		state(i).store(EMPTY, std::memory_order_relaxed);
+		values[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+concurrent_intmap::table::~table() {
+	delete[] ctrl;
+	delete[] keys;
+	delete[] values;
+}
+
+inline std::atomic<uint8_t>& concurrent_intmap::table::state(uint32_t i) const {
+	return ctrl[i / GROUP].ctrl[i % GROUP];
+}
+
+inline uint64_t concurrent_intmap::hash(uint64_t k) {
+	k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ul;
+	k = (k ^ (k >> 27)) * 0x94d049bb133111ebul;
+	k = k ^ (k >> 31);
+	return k;
+}
+
+// Returns the slot holding k in the given table, or the table's capacity if it isn't there. The
+// low 7 bits of the hash are the tag, and the rest pick the first group to probe.
+uint32_t concurrent_intmap::locate(const table* t, uint64_t k) const {
 	uint64_t h = hash(k);
-	uint64_t i = h & _mask;
-	while (true) {
-		if (data[i].status == EMPTY) return;
-		if (data[i].status == FILLED && data[i].key == k) {
-			data[i].evict();
-			-- _size;
-			return;
+	uint8_t tag = h & 0x7f;
+	uint32_t g = (h >> 7) & (t->groups - 1);
+	for (uint32_t n = 0; n < t->groups; ++ n, g = (g + 1) & (t->groups - 1)) {
+		group_bits bits(t->ctrl + g);
+		for (uint32_t m = bits.match(tag); m; m &= m - 1) {
+			uint32_t i = g * GROUP + __builtin_ctz(m);
+			if (t->state(i).load(std::memory_order_acquire) == tag && t->keys[i] == k) return i;
 		}
-		i = (i + 1) & _mask;
+		if (bits.match(EMPTY)) break;
 	}
+	return t->capacity;
 }
 
-intmap::const_iterator intmap::find(uint64_t k) const {
+// Finds the slot holding k in the given table, inserting k if it is absent. Returns -1 if the
+// table has no room or has been sealed for migration; either way the caller should grow it.
+// Keys are never removed, so racing inserts of the same key always meet at the same slot.
+int64_t concurrent_intmap::claim(table* t, uint64_t k) {
 	uint64_t h = hash(k);
-	uint64_t i = h & _mask;
+	uint8_t tag = h & 0x7f;
+	uint32_t g = (h >> 7) & (t->groups - 1);
+	for (uint32_t n = 0; n < t->groups;) {
+		group_bits bits(t->ctrl + g);
+		// another thread is inserting here, possibly the same key
+		if (bits.match(BUSY)) continue;
+		for (uint32_t m = bits.match(tag); m; m &= m - 1) {
+			uint32_t i = g * GROUP + __builtin_ctz(m);
+			if (t->state(i).load(std::memory_order_acquire) == tag && t->keys[i] == k) return i;
+		}
+		if (bits.match(SEALED)) return -1;
+		if (uint32_t m = bits.match(EMPTY)) {
+			if (t->used.load(std::memory_order_relaxed) + 1 > t->capacity * 3 / 4) return -1;
+			uint32_t i = g * GROUP + __builtin_ctz(m);
+			uint8_t state = EMPTY;
+			if (!t->state(i).compare_exchange_strong(state, BUSY, std::memory_order_acquire)) continue;
+			t->used.fetch_add(1, std::memory_order_relaxed);
+			t->keys[i] = k;
+			t->state(i).store(tag, std::memory_order_release);
+			return i;
+		}
+		g = (g + 1) & (t->groups - 1);
+		++ n;
+	}
+	return -1;
+}
+
+// Migrates a full table into a new one, four times larger. Empty slots are sealed so no more keys land in the old table, and values are frozen so no
+// more updates do. Writers that run into either block here until the new table is published, then
+// retry there.
+void concurrent_intmap::grow(table* t) {
+	std::lock_guard<std::mutex> lock(grow_lock);
+	if (current.load(std::memory_order_acquire) != t) return;
+
+	table* bigger = new table(t->capacity * 4);
+	for (uint32_t i = 0; i < t->capacity; ++ i) {
+		uint8_t state = EMPTY;
+		while (!t->state(i).compare_exchange_weak(state, SEALED, std::memory_order_acq_rel)) {
+			if (state != BUSY && state != EMPTY) break;
+			state = EMPTY;
+		}
+		if (state & 0x80) continue;
+
+		uint64_t k = t->keys[i];
+		uint64_t v = t->values[i].fetch_or(FROZEN, std::memory_order_acq_rel);
+		uint64_t h = hash(k);
+		uint32_t j = ((h >> 7) & (bigger->groups - 1)) * GROUP;
+		while (bigger->state(j).load(std::memory_order_relaxed) != EMPTY) j = (j + 1) & (bigger->capacity - 1);
+		bigger->keys[j] = k;
+		bigger->values[j].store(v, std::memory_order_relaxed);
+		bigger->state(j).store(h & 0x7f, std::memory_order_relaxed);
+		bigger->used.fetch_add(1, std::memory_order_relaxed);
+	}
+	t->next.store(bigger, std::memory_order_release);
+	current.store(bigger, std::memory_order_release);
+}
+
+concurrent_intmap::concurrent_intmap() {
+	oldest = new table(GROUP);
+	current.store(oldest);
+}
+
+concurrent_intmap::~concurrent_intmap() {
+	table* t = oldest;
+	while (t) {
+		table* next = t->next.load();
+		delete t;
+		t = next;
+	}
+}
+
+concurrent_intmap::const_iterator::const_iterator(const table* t_in, uint32_t i_in):
+	t(t_in), i(i_in) {
+	while (t && i < t->capacity && (t->state(i).load(std::memory_order_acquire) & 0x80)) ++ i;
+	if (t && i == t->capacity) t = nullptr, i = 0;
+}
+
+std::pair<uint64_t, uint64_t> concurrent_intmap::const_iterator::operator*() const {
+	return { t->keys[i], t->values[i].load(std::memory_order_acquire) & ~FROZEN };
+}
+
+concurrent_intmap::const_iterator& concurrent_intmap::const_iterator::operator++() {
+	if (t) *this = const_iterator(t, i + 1);
+	return *this;
+}
+
+concurrent_intmap::const_iterator concurrent_intmap::const_iterator::operator++(int) {
+	const_iterator it = *this;
+	operator++();
+	return it;
+}
+
+bool concurrent_intmap::const_iterator::operator==(const const_iterator& other) const {
+	return t == other.t && i == other.i;
+}
+
+bool concurrent_intmap::const_iterator::operator!=(const const_iterator& other) const {
+	return !(*this == other);
+}
+
+concurrent_intmap::const_iterator concurrent_intmap::begin() const {
+	return const_iterator(current.load(std::memory_order_acquire), 0);
+}
+
+concurrent_intmap::const_iterator concurrent_intmap::end() const {
+	return const_iterator(nullptr, 0);
+}
+
+// Never blocks or retries: each table is probed at most once, and a frozen value is only followed
+// into the next table if that table has already been published.
+bool concurrent_intmap::find(uint64_t k, uint64_t& v) const {
+	for (const table* t = current.load(std::memory_order_acquire); t; t = t->next.load(std::memory_order_acquire)) {
+		uint32_t i = locate(t, k);
+		if (i == t->capacity) {
+			// a sealed table may have been searched without hitting an empty slot
+			continue;
+		}
+		uint64_t value = t->values[i].load(std::memory_order_acquire);
+		if ((value & FROZEN) && t->next.load(std::memory_order_acquire)) continue;
+		v = value & ~FROZEN;
+		return true;
+	}
+	return false;
+}
+
+void concurrent_intmap::emplace(uint64_t k, uint64_t v) {
 	while (true) {
-		if (data[i].status == EMPTY) return end();
-		uint64_t dist = (i - h) & _mask;
-		uint64_t oh = hash(data[i].key);
-		uint64_t other_dist = (i - (oh & _mask)) & _mask;
-		if (other_dist < dist) return end();
-		if (data[i].status == FILLED && data[i].key == k) {
-			return const_iterator(data + i, data + _capacity);
+		table* t = current.load(std::memory_order_acquire);
+		int64_t i = claim(t, k);
+		if (i >= 0) {
+			uint64_t old = t->values[i].load(std::memory_order_acquire);
+			while (!(old & FROZEN)) {
+				if (t->values[i].compare_exchange_weak(old, v, std::memory_order_acq_rel)) return;
+			}
 		}
-		i = (i + 1) & _mask;
+		grow(t);
 	}
 }
 
-uint32_t intmap::size() const {
-	return _size;
+bool concurrent_intmap::compare_exchange(uint64_t k, uint64_t& expected, uint64_t desired) {
+	while (true) {
+		table* t = current.load(std::memory_order_acquire);
+		int64_t i = claim(t, k);
+		if (i >= 0) {
+			uint64_t old = t->values[i].load(std::memory_order_acquire);
+			while (!(old & FROZEN)) {
+				if (old != expected) {
+					expected = old;
+					return false;
+				}
+				if (t->values[i].compare_exchange_weak(old, desired, std::memory_order_acq_rel)) return true;
+			}
+		}
+		grow(t);
+	}
 }
 
-uint32_t intmap::capacity() const {
-	return _capacity;
-}
\ No newline at end of file
+uint32_t concurrent_intmap::size() const {
+	const table* t = current.load(std::memory_order_acquire);
+	return t->used.load(std::memory_order_relaxed);
+}
+
+uint32_t concurrent_intmap::capacity() const {
+	return current.load(std::memory_order_acquire)->capacity;
+}
+
+// A key's probe length is the number of groups from the one its hash picks to the one it is in.
+void concurrent_intmap::probe_lengths(uint64_t& total, uint32_t& longest) const {
+	const table* t = current.load(std::memory_order_acquire);
+	total = 0, longest = 0;
+	for (uint32_t i = 0; i < t->capacity; ++ i) {
+		if (t->state(i).load(std::memory_order_acquire) & 0x80) continue;
+		uint32_t home = (hash(t->keys[i]) >> 7) & (t->groups - 1);
+		uint32_t length = ((i / GROUP - home) & (t->groups - 1)) + 1;
+		total += length;
+		longest = std::max(longest, length);
+	}
+}
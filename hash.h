@@ -1,21 +1,26 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <functional>
+#include <mutex>
 
+// An int-to-int map using robin-hood hashing. Deletion shifts later entries back rather than
+// leaving tombstones, so probe sequences stay as short as if the entry had never been inserted.
 class intmap {
     enum bucket_status {
-        EMPTY, GHOST, FILLED
+        EMPTY, FILLED
     };
 
+    // Keys use the full word, so that packed argument tuples don't collide. Values are
+    // limited to 62 bits, which is enough for counts and user-space addresses.
     struct bucket {
+        uint64_t key : 64;
         bucket_status status : 2;
-        uint64_t key: 62;
-        uint64_t value : 64;
+        uint64_t value : 62;
 
         bucket();
         inline void fill(uint64_t key_in, uint64_t value_in);
-        inline void evict();
         inline void clear();
     };
 
@@ -27,6 +32,9 @@ class intmap {
     inline void free();
     void copy(const bucket* bs);
     void grow();
+    void rehash(uint32_t size);
+    uint32_t locate(uint64_t k) const;
+    inline uint32_t distance(uint32_t i) const;
     inline uint64_t hash(uint64_t k) const;
 public:
     intmap();
@@ -53,4 +61,92 @@ public:
     const_iterator find(uint64_t k) const;
     uint32_t size() const;
     uint32_t capacity() const;
+
+    // Grows the table so that at least n entries fit without rehashing.
+    void reserve(uint32_t n);
+    // Shrinks the table to the smallest capacity that holds the current entries. Erasing also
+    // shrinks the table once it falls below 1/8 full.
+    void shrink_to_fit();
+
+    // Probe lengths count the buckets a lookup visits to reach an entry, so a perfectly placed
+    // entry has length 1. Both are 0 for an empty map.
+    uint32_t max_probe_length() const;
+    double average_probe_length() const;
+};
+
+// A concurrent int-to-int map for tables shared between threads. Lookups are wait-free, keys are
+// inserted by claiming slots with CAS, and values are updated in place with compare_exchange. Keys
+// are never removed, and a key that has not been inserted reads as zero. When a table fills up,
+// writers migrate its contents to a larger table while readers carry on; superseded tables are kept
+// until the map is destroyed, so a reader never touches freed memory.
+//
+// Tables are laid out Swiss-table style: a control byte per slot, holding either a 7-bit tag from the
+// key's hash or one of the states below, with keys and values in separate arrays. Probes scan the
+// control bytes a group of 16 slots at a time, and only compare keys whose tag matches.
+class concurrent_intmap {
+    enum ctrl_state : uint8_t {
+        EMPTY = 0x80, BUSY = 0xfd, SEALED = 0xfc
+    };
+
+    static const uint32_t GROUP = 16;
+
+    // Set on values that have been copied to a newer table. Never visible to callers.
+    static const uint64_t FROZEN = 1ul << 63;
+
+    struct alignas(GROUP) group {
+        std::atomic<uint8_t> ctrl[GROUP];
+    };
+
+    struct table {
+        uint32_t capacity, groups;
+        std::atomic<uint32_t> used;
+        std::atomic<table*> next;
+        group* ctrl;
+        uint64_t* keys;
+        std::atomic<uint64_t>* values;
+
+        table(uint32_t size);
+        ~table();
+        inline std::atomic<uint8_t>& state(uint32_t i) const;
+    };
+
+    std::atomic<table*> current;
+    table* oldest;
+    std::mutex grow_lock;
+
+    uint32_t locate(const table* t, uint64_t k) const;
+    int64_t claim(table* t, uint64_t k);
+    void grow(table* t);
+    static inline uint64_t hash(uint64_t k);
+public:
+    concurrent_intmap();
+    ~concurrent_intmap();
+    concurrent_intmap(const concurrent_intmap& other) = delete;
+    concurrent_intmap& operator=(const concurrent_intmap& other) = delete;
+
+    class const_iterator {
+        const table* t;
+        uint32_t i;
+    public:
+        const_iterator(const table* t_in, uint32_t i_in);
+        std::pair<uint64_t, uint64_t> operator*() const;
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        bool operator==(const const_iterator& other) const;
+        bool operator!=(const const_iterator& other) const;
+    };
+
+    // Iteration visits the current table and is only weakly consistent with concurrent inserts.
+    const_iterator begin() const;
+    const_iterator end() const;
+    bool find(uint64_t k, uint64_t& v) const;
+    void emplace(uint64_t k, uint64_t v);
+    // Replaces the value for k with desired if it equals expected. On failure, expected is
+    // updated to the current value.
+    bool compare_exchange(uint64_t k, uint64_t& expected, uint64_t desired);
+    uint32_t size() const;
+    uint32_t capacity() const;
+    // Probe lengths of the keys in the current table, in groups: the total, for a mean, and the longest.
+    // Only weakly consistent with concurrent inserts, like iteration.
+    void probe_lengths(uint64_t& total, uint32_t& longest) const;
 };
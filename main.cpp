@@ -19,11 +19,20 @@
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/ThreadPool.h>
+#include <chrono>
+#include <sys/resource.h>
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "specializer.h"
+#include "perfmap.h"
 
 
 static llvm::orc::ThreadSafeContext TSC;
@@ -76,6 +85,26 @@ public:
 
 const object::ObjectFile* CustomObjectLayer::objptr = nullptr;
 
+// Compiles modules with a ConcurrentIRCompiler, accounting the time taken
+// and the size of the object to the module's tier.
+class TieredIRCompiler : public IRCompileLayer::IRCompiler {
+  ConcurrentIRCompiler Compiler;
+
+public:
+  TieredIRCompiler(JITTargetMachineBuilder JTMB, ObjectCache *Cache = nullptr)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        Compiler(std::move(JTMB), Cache) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    auto start = std::chrono::steady_clock::now();
+    auto Obj = Compiler(M);
+    if (Obj)
+      RecordCodegen(GetModuleTier(M), std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count(), (*Obj)->getBufferSize());
+    return Obj;
+  }
+};
+
 class JIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
@@ -84,6 +113,7 @@ private:
   Triple triple;
   DataLayout DL;
   MangleAndInterner Mangle;
+  std::unique_ptr<SpecializationCache> Cache;
 
   CustomObjectLayer ObjectLayer;
   IRCompileLayer CompileLayer, SpecializeCompileLayer;
@@ -92,26 +122,39 @@ private:
   ThreadSafeContext Ctx;
 
   JITDylib& MainJD;
+  std::unique_ptr<PerfMapListener> PerfMap;
+  // Declared last so that it is joined before the layers it compiles with are destroyed.
+  std::unique_ptr<ThreadPool> CompileThreads;
 
   static Expected<ThreadSafeModule> optimizeModule(ThreadSafeModule M, const MaterializationResponsibility &R) {
-    // Create a function pass manager.
-    auto FPM = std::make_unique<legacy::FunctionPassManager>(M.getModuleUnlocked());
-
-    // Add some optimizations.
-    if (!IsDebugFlag("-no-inst")) FPM->add(new InstrumentationPass());
-    FPM->add(createCFGSimplificationPass());
-    FPM->add(createPromoteMemoryToRegisterPass());
-    FPM->add(createGVNPass());
-    FPM->add(createReassociatePass());
-    FPM->add(createConstantPropagationPass());
-    FPM->add(createInstructionCombiningPass());
-    FPM->add(createDeadCodeEliminationPass());
-    FPM->doInitialization();
-
-    // Run the optimizations over all functions in the module being added to
-    // the JIT.
-    for (auto &F : *M.getModuleUnlocked())
-      FPM->run(F);
+    // Lock the module's context, since specializations may be compiling on
+    // the worker thread at the same time.
+    M.withModuleDo([](Module &m) {
+      auto start = std::chrono::steady_clock::now();
+      // Create a function pass manager.
+      auto FPM = std::make_unique<legacy::FunctionPassManager>(&m);
+
+      // Add some optimizations. Tier 0 only does what it takes to get
+      // reasonable code quickly; hot code gets specialized at a higher tier.
+      if (!IsDebugFlag("-no-inst")) FPM->add(new InstrumentationPass());
+      FPM->add(createCFGSimplificationPass());
+      FPM->add(createPromoteMemoryToRegisterPass());
+      if (GetBaseTier() >= 1) {
+        FPM->add(createGVNPass());
+        FPM->add(createReassociatePass());
+        FPM->add(createConstantPropagationPass());
+        FPM->add(createInstructionCombiningPass());
+        FPM->add(createDeadCodeEliminationPass());
+      }
+      FPM->doInitialization();
+
+      // Run the optimizations over all functions in the module being added to
+      // the JIT.
+      for (auto &F : m)
+        FPM->run(F);
+      RecordOptimization(GetBaseTier(), std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    });
 
     return M;
   }
@@ -122,13 +165,15 @@ private:
   }
 
 public:
-  JIT(std::unique_ptr<ExecutionSession> ES, JITTargetMachineBuilder JTMB, DataLayout DL, const Triple& T, std::unique_ptr<LazyCallThroughManager>&& lcm)
+  JIT(std::unique_ptr<ExecutionSession> ES, JITTargetMachineBuilder JTMB, DataLayout DL, const Triple& T, std::unique_ptr<LazyCallThroughManager>&& lcm,
+      std::unique_ptr<SpecializationCache> cache)
       : ES(std::move(ES)),
+        Cache(std::move(cache)),
         ObjectLayer(*this->ES,
-          []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer, std::make_unique<ConcurrentIRCompiler>(JTMB)),
+          []() { return std::make_unique<CodeMemoryManager>(); }),
+        CompileLayer(*this->ES, ObjectLayer, std::make_unique<TieredIRCompiler>(JTMB)),
         TransformLayer(*this->ES, CompileLayer, optimizeModule),
-        SpecializeCompileLayer(*this->ES, ObjectLayer, std::make_unique<ConcurrentIRCompiler>(JTMB)),
+        SpecializeCompileLayer(*this->ES, ObjectLayer, std::make_unique<TieredIRCompiler>(JTMB, Cache.get())),
         SpecializeTransformLayer(*this->ES, SpecializeCompileLayer, specializeModule),
         DL(std::move(DL)), Mangle(*this->ES, this->DL),
         triple(T),
@@ -142,6 +187,36 @@ public:
     AddInternalFunctions(Mangle, syms);
     cantFail(MainJD.define(absoluteSymbols(syms)));
     CODLayer.setPartitionFunction(CompileOnDemandLayer::compileRequested); // Compile functions individually, only when they are needed.
+
+    // Name JIT'd code for profilers and debuggers. Each listener sees every object, generic and
+    // specialized alike.
+    if (IsDebugFlag("-perf-map")) {
+      PerfMap = std::make_unique<PerfMapListener>();
+      ObjectLayer.registerJITEventListener(*PerfMap);
+    }
+    if (IsDebugFlag("-jitdump")) {
+      // Only available when LLVM was built with perf support.
+      if (JITEventListener* JITDump = JITEventListener::createPerfJITEventListener())
+        ObjectLayer.registerJITEventListener(*JITDump);
+      else
+        errs() << "-jitdump: this LLVM was built without perf support\n";
+    }
+    if (IsDebugFlag("-gdb-jit"))
+      ObjectLayer.registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+
+    // With -jobs, materialize on a pool of threads instead of the thread that asked for the
+    // symbol, so that partitions and specializations compile at the same time.
+    unsigned jobs = 0;
+    if (!GetFlagValue("-jobs").getAsInteger(10, jobs) && jobs > 0) {
+      CompileThreads = std::make_unique<ThreadPool>(hardware_concurrency(jobs));
+      this->ES->setDispatchMaterialization(
+          [this](std::unique_ptr<MaterializationUnit> MU, MaterializationResponsibility MR) {
+            // ThreadPool takes copyable tasks, so share what has to be moved into them.
+            auto SharedMU = std::shared_ptr<MaterializationUnit>(std::move(MU));
+            auto SharedMR = std::make_shared<MaterializationResponsibility>(std::move(MR));
+            CompileThreads->async([SharedMU, SharedMR]() { SharedMU->materialize(std::move(*SharedMR)); });
+          });
+    }
     // SymbolMap syms;
     // syms[Mangle("puts")] = JITEvaluatedSymbol(
     //     pointerToJITTargetAddress(&puts), JITSymbolFlags());
@@ -153,7 +228,9 @@ public:
     //   ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<JIT>> Create() {
+  // Specialized objects are cached in, and loaded from, the given cache if
+  // there is one.
+  static Expected<std::unique_ptr<JIT>> Create(std::unique_ptr<SpecializationCache> cache) {
     auto SSP = std::make_shared<SymbolStringPool>();
     auto ES = std::make_unique<ExecutionSession>(std::move(SSP));
 
@@ -169,7 +246,7 @@ public:
     if (!LCM)
       return LCM.takeError();
 
-    return std::make_unique<JIT>(std::move(ES), std::move(*JTMB), std::move(*DL), JTMB->getTargetTriple(), std::move(*LCM));
+    return std::make_unique<JIT>(std::move(ES), std::move(*JTMB), std::move(*DL), JTMB->getTargetTriple(), std::move(*LCM), std::move(cache));
   }
 
   void addLibrary(const char* fileName) {
@@ -180,7 +257,7 @@ public:
   const DataLayout &getDataLayout() const { return DL; }
 
   Error addModule(ThreadSafeModule&& TSM) {
-    InitSpecializer(&MainJD, &SpecializeTransformLayer, TSC);
+    InitSpecializer(&MainJD, &SpecializeTransformLayer, TSC, Cache.get());
     return CODLayer.add(MainJD, std::move(TSM));
   }
 
@@ -202,6 +279,36 @@ static std::unordered_set<std::string> valid_flags = {
   "-dbgloads", // log output when symbols are loaded into an object
   "-no-inst", // disable instrumentation
   "-no-spec", // disable specialization
+  "-sync-spec", // compile specializations on the calling thread
+  "-no-ic", // disable per-call-site inline caches
+  "-log-cache", // log object cache hits and writes
+  "-no-transitive", // do not specialize calls made by specialized code
+  "-O3", // use O3 rather than O2 for tier 2
+  "-log-tiers", // log compile time and code size per tier at exit
+  "-stats", // report per-function dispatch and compile stats at exit and on SIGUSR1
+  "-perf-map", // write /tmp/perf-<pid>.map for perf
+  "-jitdump", // write jitdump records for perf inject
+  "-gdb-jit", // register JIT'd objects with GDB
+  "-log-startup", // log startup time and peak RSS before running main
+  "-memo", // remember results of pure functions at their call sites
+  "-no-osr", // do not count loop iterations or enter hot loops in optimized code
+  "-no-devirt", // do not profile indirect call targets or call hot ones directly
+  "-log-thresholds", // log the specialization threshold chosen for each called function
+};
+
+static std::unordered_set<std::string> valued_flags = {
+  "-cache-dir", // directory for the persistent specialization cache
+  "-cache-size", // size limit of the specialization cache, in megabytes
+  "-profile-out", // file to write argument profiles to at exit
+  "-profile-in", // file to read argument profiles from at startup
+  "-code-budget", // limit on the memory used by specialized code, in kilobytes
+  "-sample", // count one in every N calls instead of every call
+  "-base-tier", // tier generic code is compiled at
+  "-max-tier", // highest tier specializations are compiled at
+  "-batch", // most specializations compiled together in one module
+  "-jobs", // threads to compile on
+  "-stats-json", // file to write stats to as JSON
+  "-threshold", // calls with the same argument before specializing, for every function
 };
 
 void printUsage() {
@@ -212,6 +319,33 @@ void printUsage() {
   outs() << " -dbgloads : Log output when symbols are loaded.\n";
   outs() << " -no-inst : Disable instrumentation. Effectively disables specialization.\n";
   outs() << " -no-spec : Disable specialization. Still incurs profiling overhead.\n";
+  outs() << " -sync-spec : Compile specializations on the calling thread instead of in the background.\n";
+  outs() << " -no-ic : Disable inline caches. Every instrumented call goes through the runtime.\n";
+  outs() << " -log-cache : Log specialization cache hits and writes.\n";
+  outs() << " -no-transitive : Do not specialize calls with constant arguments made by specialized code.\n";
+  outs() << " -O3 : Optimize tier 2 specializations with O3 rather than O2.\n";
+  outs() << " -log-tiers : Log compile time and code size for each tier at exit.\n";
+  outs() << " -perf-map : Write symbols for JIT'd code, specializations included, to /tmp/perf-<pid>.map for perf.\n";
+  outs() << " -jitdump : Write jitdump records for perf inject. Needs LLVM built with perf support.\n";
+  outs() << " -gdb-jit : Register JIT'd objects with GDB's JIT interface.\n";
+  outs() << " -log-startup : Log the time taken to start up, and the peak RSS, before running main.\n";
+  outs() << " -memo : Remember the results of hot calls to pure functions at their call sites, instead of specializing them. Needs inline caches.\n";
+  outs() << " -no-osr : Disable on-stack replacement. Hot loops keep running in generic code until their function returns.\n";
+  outs() << " -no-devirt : Disable value profiles of indirect calls. Specialized code calls through the pointer without checking for hot targets.\n";
+  outs() << " -log-thresholds : Log the specialization threshold the cost model chooses for each function, when it is first compiled.\n";
+  outs() << " -stats : Report per-function dispatch counts, table health and compile costs to stderr at exit, and on SIGUSR1.\n";
+  outs() << " -cache-dir <dir> : Cache specialized code in <dir> across runs.\n";
+  outs() << " -cache-size <MB> : Size limit of the specialization cache. Defaults to " << CACHE_DEFAULT_SIZE_MB << ".\n";
+  outs() << " -profile-out <file> : Write the argument profile to <file> at exit.\n";
+  outs() << " -profile-in <file> : Specialize the hot arguments recorded in <file> before running.\n";
+  outs() << " -code-budget <KB> : Evict the least used specializations once their code exceeds <KB>.\n";
+  outs() << " -sample <N> : Profile one in every N calls at each call site, instead of every call. Needs inline caches.\n";
+  outs() << " -base-tier <0|1> : Tier generic code is compiled at. Defaults to 0.\n";
+  outs() << " -max-tier <1|2> : Highest tier specializations are compiled at. Defaults to 2.\n";
+  outs() << " -batch <n> : Compile up to n pending specializations together in one module. Defaults to 16.\n";
+  outs() << " -jobs <n> : Compile on a pool of n threads, each with its own context for specializations. Defaults to compiling on the thread that needs the code.\n";
+  outs() << " -threshold <n> : Specialize every function on an argument after n calls with it, instead of the number the cost model chooses. At most " << THRESHOLD_MAX << ".\n";
+  outs() << " -stats-json <file> : Write the stats reported by -stats to <file> as JSON, at exit and on SIGUSR1.\n";
 }
 
 int main(int argc, char** argv) {
@@ -222,6 +356,10 @@ int main(int argc, char** argv) {
 
     for (int i = 2; i < argc; i ++) {
       if (valid_flags.find(argv[i]) != valid_flags.end()) AddDebugFlag(argv[i]);
+      else if (valued_flags.find(argv[i]) != valued_flags.end() && i + 1 < argc) {
+        SetFlagValue(argv[i], argv[i + 1]);
+        i ++;
+      }
       else {
         printUsage();
         return 1;
@@ -231,10 +369,22 @@ int main(int argc, char** argv) {
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
 
+    auto start = std::chrono::steady_clock::now();
     TSC = ThreadSafeContext(std::move(std::make_unique<LLVMContext>()));
     SMDiagnostic error;
-    auto module = parseIRFile(argv[1], error, *TSC.getContext());
-    auto src_module = parseIRFile(argv[1], error, *TSC.getContext());
+    // Read the bitcode once. The module handed to the JIT is parsed in full, but the source module
+    // specializations are cloned from only loads a function's body when it is first specialized.
+    auto buffer = MemoryBuffer::getFile(argv[1]);
+    if (!buffer) {
+      errs() << "Failed to read " << argv[1] << ": " << buffer.getError().message() << "\n";
+      return 1;
+    }
+    auto module = parseIR((*buffer)->getMemBufferRef(), error, *TSC.getContext());
+    auto src_module = getLazyIRModule(MemoryBuffer::getMemBuffer((*buffer)->getMemBufferRef(), false), error, *TSC.getContext());
+    if (!module || !src_module) {
+      error.print(argv[0], errs());
+      return 1;
+    }
     DeclareInternalFunctions(*TSC.getContext(), module.get());
     DeclareInternalFunctions(*TSC.getContext(), src_module.get());
     auto tsm = std::make_unique<ThreadSafeModule>(move(module), TSC);
@@ -243,9 +393,20 @@ int main(int argc, char** argv) {
       TrackSymbol(fn.getName());
       DefineFunction(fn.getName(), &fn);
     }
-    SetSourceModule({ move(src_module), TSC });
 
-    auto optionaljit = JIT::Create();
+    std::unique_ptr<SpecializationCache> cache;
+    if (!GetFlagValue("-cache-dir").empty()) {
+      MD5 hash;
+      MD5::MD5Result digest;
+      hash.update((*buffer)->getBuffer());
+      hash.final(digest);
+      uint64_t size = CACHE_DEFAULT_SIZE_MB;
+      GetFlagValue("-cache-size").getAsInteger(10, size);
+      cache = std::make_unique<SpecializationCache>(GetFlagValue("-cache-dir"), digest.digest(), size << 20);
+    }
+    SetSourceModule({ move(src_module), TSC }, move(*buffer));
+
+    auto optionaljit = JIT::Create(std::move(cache));
     if (!optionaljit)
       outs() << optionaljit.takeError() << "\n";
     auto jit = move(optionaljit.get());
@@ -254,9 +415,29 @@ int main(int argc, char** argv) {
       errs() << "Error adding module.\n";
       return 1;
     }
+    if (!GetFlagValue("-profile-in").empty()) {
+      bool loaded = LoadProfile(GetFlagValue("-profile-in"), [&](StringRef name) -> JITTargetAddress {
+        auto sym = jit->lookup(name);
+        if (!sym) {
+          consumeError(sym.takeError());
+          return 0;
+        }
+        return sym->getAddress();
+      });
+      if (!loaded)
+        errs() << "Failed to read profile from " << GetFlagValue("-profile-in") << "\n";
+    }
     auto* main = (int(*)(int, char*[]))jit->lookup("main").get().getAddress();
+    if (IsDebugFlag("-log-startup")) {
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      errs() << "startup: " << format("%.3f", std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() / 1e3) << " ms, peak RSS " << usage.ru_maxrss << " KB\n";
+    }
 
     char args[] = "<main>";
     char* ptr = args;
-    return main(1, &ptr);
+    int result = main(1, &ptr);
+    ShutdownSpecializer();
+    return result;
 }
\ No newline at end of file
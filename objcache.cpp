@@ -0,0 +1,89 @@
+#include "objcache.h"
+#include "specializer.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+
+using namespace llvm;
+using namespace std;
+
+SpecializationCache::SpecializationCache(StringRef dir_in, StringRef source_hash_in, uint64_t max_bytes):
+    dir(dir_in.str()), source_hash(source_hash_in.str()) {
+    // Describe the host the same way JITTargetMachineBuilder::detectHost does.
+    target = sys::getHostCPUName().str();
+    StringMap<bool> features;
+    if (sys::getHostCPUFeatures(features)) {
+        for (auto& feature : features) {
+            target += (feature.second ? ",+" : ",-") + feature.first().str();
+        }
+    }
+
+    if (auto err = sys::fs::create_directories(dir)) {
+        errs() << "Failed to create cache directory " << dir << ": " << err.message() << "\n";
+        return;
+    }
+    CachePruningPolicy policy;
+    policy.Interval = chrono::seconds(0);
+    policy.MaxSizeBytes = max_bytes;
+    pruneCache(dir, policy);
+}
+
+// Cache files must start with "llvmcache-" for pruneCache to consider them.
+string SpecializationCache::getPath(const Module* M) const {
+    MD5 hash;
+    hash.update(CACHE_VERSION);
+    hash.update(source_hash);
+    hash.update(M->getModuleIdentifier());
+    hash.update(target);
+    MD5::MD5Result result;
+    hash.final(result);
+
+    SmallString<128> path(dir);
+    sys::path::append(path, "llvmcache-" + result.digest().str());
+    return path.str().str();
+}
+
+bool SpecializationCache::hasObject(const Module* M) {
+    return (bool)load(M);
+}
+
+void SpecializationCache::notifyObjectCompiled(const Module* M, MemoryBufferRef obj) {
+    if (M->getModuleFlag(UNCACHED_MD)) return;
+    // Write to a temporary file and rename it into place, so concurrent runs never read a
+    // partially written object.
+    int fd;
+    SmallString<128> tmp;
+    if (sys::fs::createUniqueFile(dir + "/llvmcache-tmp-%%%%%%%%", fd, tmp)) return;
+    {
+        raw_fd_ostream out(fd, true);
+        out << obj.getBuffer();
+    }
+    string path = getPath(M);
+    if (sys::fs::rename(tmp, path)) sys::fs::remove(tmp);
+    else if (IsDebugFlag("-log-cache")) outs() << "Cached object for " << M->getModuleIdentifier() << "\n";
+}
+
+unique_ptr<MemoryBuffer> SpecializationCache::getObject(const Module* M) {
+    auto buf = load(M);
+    if (buf && IsDebugFlag("-log-cache")) outs() << "Loaded cached object for " << M->getModuleIdentifier() << "\n";
+    return buf;
+}
+
+unique_ptr<MemoryBuffer> SpecializationCache::load(const Module* M) {
+    if (M->getModuleFlag(UNCACHED_MD)) return nullptr;
+    string path = getPath(M);
+    auto buf = MemoryBuffer::getFile(path, -1, false);
+    if (!buf) return nullptr;
+
+    auto obj = object::ObjectFile::createObjectFile((*buf)->getMemBufferRef());
+    if (!obj) {
+        consumeError(obj.takeError());
+        sys::fs::remove(path);
+        return nullptr;
+    }
+    return move(*buf);
+}
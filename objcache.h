@@ -0,0 +1,32 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <string>
+
+#define CACHE_VERSION "3"
+#define CACHE_DEFAULT_SIZE_MB 256LU
+// Module flag marking code that depends on more than the module identifier says, such as memory read
+// at compile time. Such modules are never cached.
+#define UNCACHED_MD "jiujitsu.uncached"
+
+// Persists compiled specialization objects across runs. Objects are keyed by a hash of the source
+// bitcode, the module's identifier (which names the function and its specialized arguments), the
+// host CPU and its features, and CACHE_VERSION, so objects built from stale bitcode or for another
+// machine are never found. The cache directory is pruned to a size limit on startup.
+class SpecializationCache : public llvm::ObjectCache {
+    std::string dir, source_hash, target;
+
+    std::string getPath(const llvm::Module* M) const;
+    std::unique_ptr<llvm::MemoryBuffer> load(const llvm::Module* M);
+public:
+    SpecializationCache(llvm::StringRef dir_in, llvm::StringRef source_hash_in, uint64_t max_bytes);
+
+    // Returns true if a valid object is cached for the module. Corrupt objects are removed.
+    bool hasObject(const llvm::Module* M);
+
+    void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override;
+};
@@ -0,0 +1,43 @@
+#include "perfmap.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include <unistd.h>
+
+using namespace llvm;
+using namespace std;
+
+PerfMapListener::PerfMapListener() {
+    string path = "/tmp/perf-" + to_string(getpid()) + ".map";
+    error_code ec;
+    out = make_unique<raw_fd_ostream>(path, ec, sys::fs::OF_Text);
+    if (ec) {
+        errs() << "Failed to open " << path << ": " << ec.message() << "\n";
+        out.reset();
+    }
+}
+
+// Symbols are read from the object as relocated for debugging, so their addresses are where the
+// code was loaded.
+void PerfMapListener::notifyObjectLoaded(ObjectKey key, const object::ObjectFile& obj,
+                                         const RuntimeDyld::LoadedObjectInfo& info) {
+    if (!out) return;
+    object::OwningBinary<object::ObjectFile> debug = info.getObjectForDebug(obj);
+    if (!debug.getBinary()) return;
+    lock_guard<mutex> guard(lock);
+    for (const auto& sym : object::computeSymbolSizes(*debug.getBinary())) {
+        auto type = sym.first.getType();
+        auto name = sym.first.getName();
+        auto addr = sym.first.getAddress();
+        if (!type || !name || !addr) {
+            if (!type) consumeError(type.takeError());
+            if (!name) consumeError(name.takeError());
+            if (!addr) consumeError(addr.takeError());
+            continue;
+        }
+        if (*type != object::SymbolRef::ST_Function || !sym.second) continue;
+        *out << format("%lx %lx ", *addr, sym.second) << *name << "\n";
+    }
+    // so that the entries survive the process being killed
+    out->flush();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <mutex>
+
+// Writes an entry to /tmp/perf-<pid>.map for every function in every object the JIT loads, so that
+// perf can name samples that land in JIT'd code, specializations (<name>_<arg>) included. perf reads
+// the map after the process has exited, so entries are never removed, even for evicted
+// specializations whose memory has been freed.
+class PerfMapListener : public llvm::JITEventListener {
+    std::mutex lock;
+    std::unique_ptr<llvm::raw_fd_ostream> out;
+public:
+    PerfMapListener();
+
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile& obj,
+                            const llvm::RuntimeDyld::LoadedObjectInfo& info) override;
+};
@@ -1,9 +1,43 @@
 #include "specializer.h"
 #include <unordered_map>
 #include <unordered_set>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
 #include "hash.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/CallPromotionUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/FunctionAttrs.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
 #include "llvm/Transforms/Scalar/GVN.h"
@@ -12,10 +46,13 @@ using namespace llvm;
 using namespace llvm::orc;
 using namespace std;
 
-static unordered_set<string> symbols;
-static intmap func_counter;
-static unordered_map<string, Function*> function_ir;
+// The function and flag tables are only written during startup, before any guest code runs, and
+// are read-only afterwards, so guest threads and the compile worker can read them without locking.
 static unordered_set<string> debug_flags;
+static unordered_map<string, string> flag_values;
+static uint64_t sample_period = 0; // calls per sample with -sample, or 0 to count every call
+static bool stats_enabled = false; // -stats or -stats-json
+static unsigned base_tier = 0, max_tier = 2;
 
 void AddDebugFlag(StringRef str) {
     debug_flags.insert(str.str());
@@ -25,159 +62,1488 @@ bool IsDebugFlag(StringRef str) {
     return debug_flags.find(str.str()) != debug_flags.end();
 }
 
+void SetFlagValue(StringRef flag, StringRef value) {
+    flag_values[flag.str()] = value.str();
+}
+
+StringRef GetFlagValue(StringRef flag) {
+    auto it = flag_values.find(flag.str());
+    return it == flag_values.end() ? StringRef() : StringRef(it->second);
+}
+
+ThreadSafeModule SRC;
+static std::unique_ptr<MemoryBuffer> SRC_BUFFER; // the bitcode SRC was lazily loaded from, and its reader still loads bodies from
+
+void SetSourceModule(ThreadSafeModule&& tsm, std::unique_ptr<MemoryBuffer> buffer) {
+    SRC = move(tsm);
+    SRC_BUFFER = move(buffer);
+}
+
+static std::unordered_map<LLVMContext*, Function*> JIT_RESOLVE_DEFS;
+static Function* JIT_RESOLVE_FN = nullptr;
+static JITDylib* DYLIB = nullptr;
+static MangleAndInterner* MANGLE = nullptr;
+
+// A request to compile a function specialized on a particular argument. Requests are
+// produced on the dispatch path and consumed by the compile worker.
+struct FunctionProfile;
+struct CompileRequest {
+    JITTargetAddress fn, arg;
+    Function* function;
+    concurrent_intmap* counter; // per-argument table the result is published into
+    unsigned tier = 1;
+    FunctionProfile* guarded = nullptr; // set instead for a guarded specialization of a megamorphic function
+    uint64_t* osr = nullptr; // set instead for a loop continuation, to the slots of the loop requesting it
+    unsigned loop = 0;
+};
+
+static JITTargetAddress Specialize(const CompileRequest& req);
+static SmallVector<JITTargetAddress, 8> SpecializeBatch(ArrayRef<CompileRequest> reqs);
+static string SpecializedName(Function* function, JITTargetAddress arg);
+static void SpecializeGuarded(FunctionProfile* profile, Function* function);
+static void SpecializeOSR(const CompileRequest& req);
+static void Reprofile(FunctionProfile* profile);
+static void ReportStats();
+static uint64_t ChooseThreshold(FunctionProfile* profile, Function* body);
+static void LoadSourceBody(Function* function);
+
+static mutex queue_lock;
+static condition_variable queue_ready;
+static deque<CompileRequest> compile_queue;
+static intmap pending; // function address -> intmap of arguments queued or compiling
+static multimap<chrono::steady_clock::time_point, FunctionProfile*> reprofiles; // megamorphic functions, by when to profile them again
+static thread worker;
+static bool stopping = false;
+static atomic<bool> stats_requested(false); // set by SIGUSR1
+static uint64_t batch_size = BATCH_SIZE;
+static uint64_t threshold_override = 0; // -threshold, or 0 to use the cost model
+
+// Queues a specialization request. Returns false if the request was dropped, either because
+// the same (function, argument) pair is already pending or because the queue is full.
+static bool EnqueueCompile(const CompileRequest& req) {
+    lock_guard<mutex> lock(queue_lock);
+    if (stopping || compile_queue.size() >= COMPILE_QUEUE_DEPTH) return false;
+    auto it = pending.find(req.fn);
+    intmap* args;
+    if (it == pending.end()) {
+        args = new intmap;
+        pending.emplace(req.fn, (uint64_t)args);
+    }
+    else args = (intmap*)(*it).second;
+    if (args->find(req.arg) != args->end()) return false;
+    args->emplace(req.arg, 1);
+    compile_queue.push_back(req);
+    queue_ready.notify_one();
+    return true;
+}
+
+// Moves queued requests that can be compiled alongside the first one in a batch into it, waiting up to
+// BATCH_WINDOW_MS for more to arrive. Requests in a batch share a tier. Must hold queue_lock.
+static void CollectBatch(unique_lock<mutex>& lock, vector<CompileRequest>& batch) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(BATCH_WINDOW_MS);
+    while (!stopping && batch.size() < batch_size) {
+        auto it = find_if(compile_queue.begin(), compile_queue.end(), [&](const CompileRequest& req) {
+            return !req.guarded && !req.osr && req.tier == batch[0].tier;
+        });
+        if (it != compile_queue.end()) {
+            batch.push_back(*it);
+            compile_queue.erase(it);
+        }
+        else if (queue_ready.wait_until(lock, deadline) == cv_status::timeout) return;
+    }
+}
+
+// Compiles queued requests in the background, in batches, publishing each finished specialization into
+// its argument table. Failed compiles are left at the threshold so they are not retried. Also restarts
+// profiling of megamorphic functions once their backoff expires, and reports stats when asked to by
+// SIGUSR1. A signal handler cannot wake the worker, so with stats on it polls every STATS_POLL_MS.
+static void CompileWorker() {
+    auto reprofile_due = [] { return !reprofiles.empty() && reprofiles.begin()->first <= chrono::steady_clock::now(); };
+    while (true) {
+        CompileRequest req;
+        vector<CompileRequest> batch;
+        FunctionProfile* due = nullptr;
+        bool report = false;
+        {
+            unique_lock<mutex> lock(queue_lock);
+            while (!stopping && compile_queue.empty() && !reprofile_due() && !stats_requested.load(memory_order_relaxed)) {
+                auto wake = chrono::steady_clock::time_point::max();
+                if (!reprofiles.empty()) wake = reprofiles.begin()->first;
+                if (stats_enabled) wake = min(wake, chrono::steady_clock::now() + chrono::milliseconds(STATS_POLL_MS));
+                if (wake == chrono::steady_clock::time_point::max()) queue_ready.wait(lock);
+                else queue_ready.wait_until(lock, wake);
+            }
+            if (stopping) return;
+            if (stats_requested.exchange(false, memory_order_relaxed)) report = true;
+            else if (reprofile_due()) {
+                due = reprofiles.begin()->second;
+                reprofiles.erase(reprofiles.begin());
+            }
+            else {
+                req = compile_queue.front();
+                compile_queue.pop_front();
+                if (!req.guarded && !req.osr) {
+                    batch.push_back(req);
+                    CollectBatch(lock, batch);
+                    if (stopping) return;
+                }
+            }
+        }
+        if (report) {
+            ReportStats();
+            continue;
+        }
+        if (due) {
+            Reprofile(due);
+            continue;
+        }
+        if (req.guarded) {
+            SpecializeGuarded(req.guarded, req.function);
+            continue;
+        }
+        if (req.osr) {
+            SpecializeOSR(req);
+            continue;
+        }
+        SpecializeBatch(batch);
+        lock_guard<mutex> lock(queue_lock);
+        for (const CompileRequest& done : batch)
+            ((intmap*)(*pending.find(done.fn)).second)->erase(done.arg);
+    }
+}
+
+// A specialization whose code memory counts against the -code-budget. Its prologue and epilogue
+// maintain a pair of counters: the calls made to it since the last eviction pass, and the calls to it
+// currently running.
+struct Specialization {
+    string symbol;
+    JITTargetAddress fn = 0, arg = 0, addr = 0;
+    concurrent_intmap* table = nullptr; // argument table the address is published in
+    CodeMemoryManager* memory = nullptr;
+    uint64_t counters[2] = { 0, 0 }; // hits, active
+    vector<uint64_t*> slots; // inline cache slots the address was written to
+    uint64_t retired = 0; // the code epoch it was evicted in
+};
+
+// Code memory accounting. Only used when a budget is set.
+static mutex code_lock;
+static uint64_t code_budget = 0; // in bytes, or 0 for no limit
+static uint64_t code_bytes = 0; // memory used by published specializations
+static unordered_map<string, Specialization*> code_symbols; // compiled and not yet evicted
+static unordered_map<JITTargetAddress, Specialization*> code_live; // published
+static vector<Specialization*> quarantine; // evicted, but possibly still running
+
+// Guest threads, for telling when evicted code can no longer be reached. A call can load a
+// specialization's address, from an inline cache or the argument table, and be descheduled before its
+// prologue counts it as running, and a call that has counted itself out still has to return through
+// the epilogue. Eviction therefore advances the code epoch, and each thread records the epoch it last
+// saw at a point where it holds no such address: on entry to the runtime, and around pthread_join,
+// where it records 0 while blocked. Code evicted in an epoch is freed once every thread has recorded
+// that epoch or later, or is blocked. Threads are registered as they start, through pthread_create,
+// or otherwise on their first call into the runtime, and unregistered as they exit.
+struct GuestThread {
+    atomic<uint64_t> epoch{0};
+    bool registered = false;
+    ~GuestThread();
+};
+static atomic<uint64_t> code_epoch(1);
+static mutex guest_lock;
+static unordered_set<GuestThread*> guest_threads; // guarded by guest_lock
+static thread_local GuestThread guest_thread;
+
+GuestThread::~GuestThread() {
+    if (!registered) return;
+    lock_guard<mutex> lock(guest_lock);
+    guest_threads.erase(this);
+}
+
+// Records that this thread holds no specialized address it has yet to call or return from.
+static inline void Quiesce() {
+    if (!guest_thread.registered) {
+        guest_thread.registered = true;
+        lock_guard<mutex> lock(guest_lock);
+        guest_threads.insert(&guest_thread);
+    }
+    guest_thread.epoch.store(code_epoch.load(memory_order_seq_cst), memory_order_seq_cst);
+}
+
+// Stand-ins for the guest's pthread_create and pthread_join, which register new threads before they
+// run any guest code, and let threads blocked in a join hold no evicted code up.
+struct GuestThreadStart {
+    void* (*start)(void*);
+    void* arg;
+};
+
+static void* StartGuestThread(void* data) {
+    GuestThreadStart start = *(GuestThreadStart*)data;
+    delete (GuestThreadStart*)data;
+    Quiesce();
+    return start.start(start.arg);
+}
+
+extern "C" int JITCreateThread(pthread_t* thread, const pthread_attr_t* attr, void* (*start)(void*), void* arg) {
+    GuestThreadStart* data = new GuestThreadStart{ start, arg };
+    int err = pthread_create(thread, attr, StartGuestThread, data);
+    if (err) delete data;
+    return err;
+}
+
+extern "C" int JITJoinThread(pthread_t thread, void** result) {
+    guest_thread.epoch.store(0, memory_order_seq_cst);
+    int err = pthread_join(thread, result);
+    Quiesce();
+    return err;
+}
+
+// Inline cache slots emptied by eviction. These keep their key, and may only be refilled for that key:
+// a call racing with the refill could see the new target alongside the old key.
+static mutex ic_lock;
+static unordered_set<uint64_t*> retired_slots;
+
+// Publishes a specialized address into a free slot of a call site's inline cache, so that later
+// calls from that site with the same argument no longer reach the runtime. The key is written
+// before the target, and the target is what marks the slot as filled. Fills are rare, so they
+// are serialized to stop two threads from claiming the same slot.
+static void FillInlineCache(uint64_t* site, uint64_t arg, uint64_t addr) {
+    if (!site) return;
+    // The address may have been evicted since it was looked up. If not, eviction has to know to
+    // empty this slot again.
+    unique_lock<mutex> code(code_lock, defer_lock);
+    Specialization* spec = nullptr;
+    if (code_budget) {
+        code.lock();
+        auto it = code_live.find(addr);
+        if (it == code_live.end()) return;
+        spec = it->second;
+    }
+    lock_guard<mutex> lock(ic_lock);
+    for (uint64_t i = 0; i < INLINE_CACHE_SIZE; i ++) {
+        uint64_t* slot = site + 2 * i;
+        uint64_t target = __atomic_load_n(slot + 1, __ATOMIC_ACQUIRE);
+        if (!target) {
+            if (retired_slots.count(slot) && slot[0] != arg) continue;
+            __atomic_store_n(slot, arg, __ATOMIC_RELAXED);
+            __atomic_store_n(slot + 1, addr, __ATOMIC_RELEASE);
+            if (spec) spec->slots.push_back(slot);
+            return;
+        }
+        if (slot[0] == arg) return;
+    }
+}
+
+// With -memo, the inline cache of a site calling a pure function is followed by MEMO_SLOTS (key, result,
+// filled) slots, and then by a request for the site to record the result of its next call with a key:
+// a flag, and the key.
+static const uint64_t MEMO_BASE = 2 * INLINE_CACHE_SIZE + 2, MEMO_REQUEST = MEMO_BASE + 3 * MEMO_SLOTS;
+
+// Publishes a result into a free memo slot of a call site, like FillInlineCache. Memo slots are never
+// emptied, since a pure function's result for a key cannot change. Returns false if they are all taken
+// by other keys.
+static bool FillMemoCache(uint64_t* site, uint64_t key, uint64_t result) {
+    lock_guard<mutex> lock(ic_lock);
+    for (uint64_t i = 0; i < MEMO_SLOTS; i ++) {
+        uint64_t* slot = site + MEMO_BASE + 3 * i;
+        if (!__atomic_load_n(slot + 2, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(slot, key, __ATOMIC_RELAXED);
+            __atomic_store_n(slot + 1, result, __ATOMIC_RELAXED);
+            __atomic_store_n(slot + 2, 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (slot[0] == key) return true;
+    }
+    return false;
+}
+
+// Returns true if a site has a memo slot left. Slots are filled in order, so only the last is checked.
+static bool HasMemoSlot(uint64_t* site) {
+    return !__atomic_load_n(site + MEMO_BASE + 3 * (MEMO_SLOTS - 1) + 2, __ATOMIC_ACQUIRE);
+}
+
+// Asks a site to pass the result of its next call with the given key to JITMemoize. A later request
+// replaces an earlier one that has not been answered yet.
+static void RequestMemo(uint64_t* site, uint64_t key) {
+    __atomic_store_n(site + MEMO_REQUEST + 1, key, __ATOMIC_RELAXED);
+    __atomic_store_n(site + MEMO_REQUEST, 1, __ATOMIC_RELEASE);
+}
+
+// Unpublishes a specialization, so that calls can no longer reach it, and returns its argument to
+// counting so it can be specialized again if it gets hot. Its memory is freed by a later pass, once
+// every guest thread has moved past the epoch it was evicted in.
+static void Evict(Specialization* spec) {
+    uint64_t expected = spec->addr;
+    spec->table->compare_exchange(spec->arg, expected, 0);
+    {
+        lock_guard<mutex> lock(ic_lock);
+        for (uint64_t* slot : spec->slots) {
+            if (__atomic_load_n(slot + 1, __ATOMIC_RELAXED) != spec->addr) continue;
+            __atomic_store_n(slot + 1, 0, __ATOMIC_RELEASE);
+            retired_slots.insert(slot);
+        }
+    }
+    code_live.erase(spec->addr);
+    code_symbols.erase(spec->symbol);
+    if (spec->memory) code_bytes -= spec->memory->size();
+    // Drop the symbols too, so the argument can be specialized under the same name again.
+    if (Error err = DYLIB->remove({ (*MANGLE)(spec->symbol), (*MANGLE)(spec->symbol + ".counters") })) {
+        errs() << "Failed to remove specialized function " << spec->symbol << ": " << err << "\n";
+        consumeError(std::move(err));
+    }
+    spec->retired = code_epoch.fetch_add(1, memory_order_seq_cst) + 1;
+    quarantine.push_back(spec);
+}
+
+// Evicts the coldest specializations until published code fits in the budget, never evicting keep.
+// Eviction takes two passes: the first unpublishes a specialization, and a later one frees its memory
+// once no calls to it are running and every guest thread has been through a point where it could not
+// be about to enter it (see GuestThread). Must be called with code_lock held.
+static void EnforceCodeBudget(Specialization* keep) {
+    uint64_t oldest = UINT64_MAX;
+    {
+        lock_guard<mutex> lock(guest_lock);
+        for (GuestThread* thread : guest_threads) {
+            uint64_t epoch = thread->epoch.load(memory_order_seq_cst);
+            if (epoch) oldest = min(oldest, epoch);
+        }
+    }
+    for (auto it = quarantine.begin(); it != quarantine.end(); ) {
+        Specialization* spec = *it;
+        if (spec->retired > oldest || __atomic_load_n(&spec->counters[1], __ATOMIC_ACQUIRE)) {
+            ++ it;
+            continue;
+        }
+        if (spec->memory) spec->memory->release();
+        delete spec;
+        it = quarantine.erase(it);
+    }
+    if (code_bytes <= code_budget) return;
+
+    vector<Specialization*> candidates;
+    for (auto& entry : code_live)
+        if (entry.second != keep && entry.second->memory) candidates.push_back(entry.second);
+    llvm::sort(candidates, [](Specialization* a, Specialization* b) {
+        return __atomic_load_n(&a->counters[0], __ATOMIC_RELAXED) < __atomic_load_n(&b->counters[0], __ATOMIC_RELAXED);
+    });
+    for (Specialization* spec : candidates) {
+        if (code_bytes <= code_budget) break;
+        Evict(spec);
+    }
+    // age the survivors, so that the next pass favors recent calls
+    for (auto& entry : code_live) {
+        uint64_t* hits = &entry.second->counters[0];
+        __atomic_store_n(hits, __atomic_load_n(hits, __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+    }
+}
+
+// Specializations being compiled with -stats on, and the size of the object each was loaded in,
+// once it has been. Guarded by code_lock.
+static unordered_map<string, uint64_t> loading_sizes;
+
+void TrackCodeMemory(StringRef symbol, CodeMemoryManager* memory) {
+    if (!code_budget && !stats_enabled) return;
+    lock_guard<mutex> lock(code_lock);
+    auto it = code_symbols.find(symbol.str());
+    if (it != code_symbols.end()) it->second->memory = memory;
+    auto loading = loading_sizes.find(symbol.str());
+    if (loading != loading_sizes.end()) loading->second = memory->size();
+}
+
+// Returns the name a function is given when specialized on a particular input.
+static string SpecializedName(Function* function, JITTargetAddress arg) {
+    return function->getName().str() + "_" + to_string((uint64_t)arg);
+}
+
+// Publishes a compiled specialization into its argument table, where calls will find it.
+static void Publish(const CompileRequest& req, JITTargetAddress addr) {
+    if (!code_budget) {
+        req.counter->emplace(req.arg, addr);
+        return;
+    }
+    lock_guard<mutex> lock(code_lock);
+    Specialization* spec = nullptr;
+    auto it = code_symbols.find(SpecializedName(req.function, req.arg));
+    if (it != code_symbols.end()) {
+        spec = it->second;
+        spec->fn = req.fn;
+        spec->arg = req.arg;
+        spec->addr = addr;
+        spec->table = req.counter;
+        code_live[addr] = spec;
+        if (spec->memory) code_bytes += spec->memory->size();
+    }
+    req.counter->emplace(req.arg, addr);
+    EnforceCodeBudget(spec);
+}
+
+// Compiles a batch of specializations at the same tier together, and publishes each one. Returns
+// their addresses, in order, with 0 for any that failed.
+static SmallVector<JITTargetAddress, 8> SpecializeBatch(ArrayRef<CompileRequest> reqs) {
+    SmallVector<pair<Function*, JITTargetAddress>, 8> targets;
+    for (const CompileRequest& req : reqs) targets.push_back({ req.function, req.arg });
+    SmallVector<JITTargetAddress, 8> addrs = CompileFunctions(targets, reqs[0].tier);
+    for (size_t i = 0; i < reqs.size(); i ++) {
+        if (addrs[i]) Publish(reqs[i], addrs[i]);
+        else {
+            DYLIB->dump(errs());
+            errs() << "Failed to compile function!\n";
+        }
+    }
+    return addrs;
+}
+
+// Compiles a single specialization and publishes it. Returns the specialized address, or 0 if the
+// compile failed.
+static JITTargetAddress Specialize(const CompileRequest& req) {
+    return SpecializeBatch(req)[0];
+}
+
+// Returns the number of bits a specialized parameter of the given type takes up in a key, or 0 if
+// parameters of the type are not specialized on. Integers and floating-point values are keyed on
+// their bits, and pointers on their address.
+static unsigned keyBits(Type* t) {
+    if (t->isPointerTy()) return t->getPointerAddressSpace() == 0 ? sizeof(void*) * 8 : 0;
+    if (t->isIntegerTy() || t->isHalfTy() || t->isFloatTy() || t->isDoubleTy()) return t->getPrimitiveSizeInBits();
+    return 0;
+}
+
+// Facts about a specialized parameter that held for every argument it was seen with.
+struct ArgFacts {
+    unsigned idx, bits;
+    int64_t min = INT64_MAX, max = INT64_MIN; // as signed values of the parameter's width
+    uint64_t ones = 0; // bits set in any of the values
+    bool pow2 = true;
+
+    bool ranged() const { return (uint64_t)max - (uint64_t)min < GUARD_RANGE_LIMIT; }
+    bool nonnegative() const { return min >= 0; }
+    unsigned alignment() const { return ones ? countTrailingZeros(ones) : 0; } // log2
+    bool useful() const { return ranged() || nonnegative() || pow2 || alignment(); }
+};
+
+// Returns the useful facts about the arguments in a function's table. Returns nothing for varargs
+// functions, which cannot forward their arguments to the generic version when a guard fails.
+static SmallVector<ArgFacts, 4> FindArgFacts(Function* function, const concurrent_intmap* table) {
+    SmallVector<ArgFacts, 4> facts, useful;
+    if (function->isVarArg()) return useful;
+    SmallVector<unsigned, 4> indices = findSpecializedArgs(function);
+    // the facts are checked with integer comparisons
+    for (unsigned idx : indices) {
+        Type* argt = function->getArg(idx)->getType();
+        if (argt->isIntegerTy() && argt->getIntegerBitWidth() > 1) facts.push_back({ idx, argt->getIntegerBitWidth() });
+    }
+    for (auto it = table->begin(); it != table->end(); ++ it) {
+        uint64_t key = (*it).first;
+        unsigned offset = 0;
+        for (unsigned idx : indices) {
+            unsigned bits = keyBits(function->getArg(idx)->getType());
+            uint64_t value = bits == 64 ? key >> offset : (key >> offset) & ((1ul << bits) - 1);
+            offset += bits;
+            for (ArgFacts& f : facts) {
+                if (f.idx != idx) continue;
+                int64_t signed_value = SignExtend64(value, bits);
+                f.min = std::min(f.min, signed_value);
+                f.max = std::max(f.max, signed_value);
+                f.ones |= value;
+                f.pow2 &= isPowerOf2_64(value);
+            }
+        }
+    }
+    for (ArgFacts& f : facts)
+        if (f.min <= f.max && f.useful()) useful.push_back(f);
+    return useful;
+}
+
+// Everything recorded about a tracked function. The name is kept so that profiles can be
+// written out and matched up with the same function in a later run.
+//
+// A function that sees more than MEGAMORPHIC_LIMIT distinct arguments before any of them gets hot is
+// megamorphic. Profiling it is not worth the cost, so its call sites are pointed straight at the
+// generic function, and its argument table is retired until a backoff period has passed. If the
+// arguments it was seen with had facts in common, the call sites are pointed at a version of the
+// function guarded on those facts instead.
+enum Purity { PURITY_UNKNOWN, PURITY_PURE, PURITY_IMPURE };
+
+struct FunctionProfile {
+    string name;
+    Function* function = nullptr; // in the source module, if defined
+    atomic<concurrent_intmap*> args; // argument -> call count, or specialized address
+    atomic<uint64_t> threshold{0}; // calls an argument needs to be specialized; 0 until ChooseThreshold decides it, when the function is first compiled
+    atomic<bool> requested{false}; // an argument has reached the threshold
+    atomic<uint64_t> calls{0}; // counted calls, for choosing a tier
+    atomic<bool> megamorphic{false};
+    uint64_t backoff = 0; // milliseconds until profiling restarts; guarded by queue_lock
+    vector<uint64_t*> sites; // inline caches falling back to the generic function; guarded by ic_lock
+    JITTargetAddress guarded = 0; // latest guarded version, if any; guarded by ic_lock
+    unordered_map<string, JITTargetAddress> guards; // guarded versions by name; only used by the compile worker
+    atomic<int> purity{PURITY_UNKNOWN}; // decided by IsPure before the first call site is instrumented
+    concurrent_intmap* memo = nullptr; // key -> result, for pure functions with -memo; set along with purity
+    unordered_map<unsigned, uint64_t*> target_sites; // value profiles of indirect calls, by ordinal; guarded by ic_lock
+
+    // For -stats. Calls into the runtime are counted per thread instead; see CountDispatch.
+    atomic<uint64_t> specialized_calls{0}; // counted on entry by specialized code; racing calls may be lost
+    atomic<uint64_t> specializations{0}, compile_ns{0}, code_bytes{0};
+
+    FunctionProfile(StringRef name_in): name(name_in.str()), args(new concurrent_intmap) {}
+};
+
+// Each tracked function is given a dense ID when it is registered, which indexes its profile.
+// Instrumented calls pass the ID, so the dispatch path never hashes a name or an address; names
+// are only looked up while compiling and reading profiles.
+static deque<FunctionProfile> profiles; // by ID; a deque, so that profiles never move
+static unordered_map<string, unsigned> function_ids;
+
 // Logs all symbols currently tracked by the specializer.
 void LogSymbols(llvm::raw_ostream& io) {
-    for (const string& s : symbols) io << s << "\n";
+    for (const FunctionProfile& profile : profiles) io << profile.name << "\n";
 }
 
 // Registers a symbol with the specializer as a function belonging to an
 // active module. This means that calls to this function will be trampolined
 // in the instrumentation pass.
-void TrackSymbol(llvm::StringRef str) {
-    symbols.insert(str.str());
+unsigned TrackSymbol(llvm::StringRef str) {
+    auto it = function_ids.emplace(str.str(), profiles.size());
+    if (it.second) profiles.emplace_back(str);
+    return it.first->second;
 }
 
-ThreadSafeModule SRC;
+// Defines a function for a particular name.
+void DefineFunction(llvm::StringRef str, llvm::Function* fn) {
+    profiles[TrackSymbol(str)].function = fn;
+}
 
-void SetSourceModule(ThreadSafeModule&& tsm) {
-    SRC = move(tsm);
+// Returns the profile of a tracked function, or null if the name is not tracked.
+static FunctionProfile* FindProfile(StringRef name) {
+    auto it = function_ids.find(name.str());
+    return it == function_ids.end() ? nullptr : &profiles[it->second];
 }
 
-// Defines a function for a particular name.
-void DefineFunction(llvm::StringRef str, llvm::Function* fn) {
-    function_ir[str.str()] = fn;
+// Calls counted by this thread but not yet added to the shared argument tables. Each thread batches
+// the calls for recently seen (function, argument) pairs, so a hot count is written to shared memory
+// once every COUNT_BATCH calls rather than bouncing between cores on every call.
+struct CountShard {
+    FunctionProfile* profile;
+    concurrent_intmap* table;
+    JITTargetAddress fn; // the generic function, to specialize if a flush reaches the threshold
+    uint64_t arg, count;
+};
+static thread_local CountShard shards[COUNT_SHARDS];
+
+// Runtime call counters for -stats, per thread and by function ID: calls into the runtime, calls it
+// sent to a specialization, and calls it sent straight to the generic function of a megamorphic
+// function. Each thread only writes its own, so counting needs no atomic read-modify-write. They are
+// summed when stats are reported, and never freed, so threads that have exited are still counted.
+enum DispatchCounter { DISPATCH_CALLS, DISPATCH_HITS, DISPATCH_MEGAMORPHIC, DISPATCH_COUNTERS };
+static mutex dispatch_lock;
+static vector<atomic<uint64_t>*> dispatch_counts; // one array per thread; guarded by dispatch_lock
+static thread_local atomic<uint64_t>* thread_dispatch_counts = nullptr;
+
+static inline void CountDispatch(uint64_t id, DispatchCounter counter) {
+    if (!stats_enabled) return;
+    if (!thread_dispatch_counts) {
+        thread_dispatch_counts = new atomic<uint64_t>[profiles.size() * DISPATCH_COUNTERS]();
+        lock_guard<mutex> lock(dispatch_lock);
+        dispatch_counts.push_back(thread_dispatch_counts);
+    }
+    atomic<uint64_t>& count = thread_dispatch_counts[id * DISPATCH_COUNTERS + counter];
+    count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
 }
 
-static std::unordered_map<LLVMContext*, Function*> JIT_RESOLVE_DEFS;
-static Function* JIT_RESOLVE_FN = nullptr;
-static JITDylib* DYLIB = nullptr;
-static SpecializationPass* SPECIALIZE = nullptr;
+static bool AddCalls(concurrent_intmap* table, uint64_t arg, uint64_t calls, uint64_t limit);
+
+// Adds a shard's calls to the shared count, unless the table they were counted against has since
+// been retired. Retired tables are only freed a backoff period later. Returns true if the flush took
+// the count to the threshold, in which case the caller is responsible for specializing, as for a full
+// batch. With final set, as at exit, the count stops just below the threshold instead.
+static bool FlushShard(const CountShard& shard, bool final = false) {
+    if (shard.profile->args.load(memory_order_acquire) != shard.table) return false;
+    shard.profile->calls.fetch_add(shard.count, memory_order_relaxed);
+    return AddCalls(shard.table, shard.arg, shard.count, shard.profile->threshold.load(memory_order_relaxed) - final);
+}
+
+// Chooses the tier to specialize a function at, from the calls it has had so far.
+static unsigned ChooseTier(FunctionProfile* profile) {
+    unsigned tier = profile->calls.load(memory_order_relaxed) >= TIER2_CALLS ? 2 : 1;
+    return min(tier, max_tier);
+}
+
+// Points a call site's inline cache at the generic function, so that calls from it which miss the
+// cache no longer reach the runtime.
+static void SetFallback(FunctionProfile* profile, uint64_t* site, JITTargetAddress fn) {
+    if (!site) return;
+    lock_guard<mutex> lock(ic_lock);
+    uint64_t* fallback = site + 2 * INLINE_CACHE_SIZE;
+    if (!profile->megamorphic.load(memory_order_relaxed) || *fallback) return;
+    __atomic_store_n(fallback, profile->guarded ? profile->guarded : fn, __ATOMIC_RELAXED);
+    profile->sites.push_back(site);
+}
+
+// Stops profiling a function, and schedules profiling to restart once its backoff has passed. The
+// backoff doubles every time the function is found to be megamorphic. Also queues a guarded version
+// of the function, which the compile worker builds from the facts left in its argument table.
+static void MarkMegamorphic(FunctionProfile* profile, Function* function) {
+    bool expected = false;
+    if (!profile->megamorphic.compare_exchange_strong(expected, true)) return;
+    lock_guard<mutex> lock(queue_lock);
+    profile->backoff = profile->backoff ? min(profile->backoff * 2, REPROFILE_MAX_DELAY_MS) : REPROFILE_DELAY_MS;
+    reprofiles.emplace(chrono::steady_clock::now() + chrono::milliseconds(profile->backoff), profile);
+    if (function && !IsDebugFlag("-no-spec") && compile_queue.size() < COMPILE_QUEUE_DEPTH) {
+        CompileRequest req = { 0, 0, function, nullptr };
+        req.guarded = profile;
+        compile_queue.push_back(req);
+    }
+    queue_ready.notify_one();
+}
+
+// Restarts profiling of a megamorphic function with an empty argument table, in case the program has
+// moved into a phase where a few of its arguments are hot. The old table has been unused since the
+// function was marked megamorphic, apart from calls that were already in the runtime at the time,
+// and those have had the whole backoff period to finish.
+static void Reprofile(FunctionProfile* profile) {
+    concurrent_intmap* old = profile->args.exchange(new concurrent_intmap, memory_order_acq_rel);
+    {
+        lock_guard<mutex> lock(ic_lock);
+        profile->megamorphic.store(false, memory_order_release);
+        for (uint64_t* site : profile->sites)
+            __atomic_store_n(site + 2 * INLINE_CACHE_SIZE, 0, __ATOMIC_RELAXED);
+        profile->sites.clear();
+    }
+    delete old;
+}
+
+// Adds calls to a shared count, stopping at limit. Returns true if this call reached the limit. When
+// the limit is the function's specialization threshold, the count is then held there and the caller
+// is responsible for specializing. Counts that are already at the limit or hold an address are
+// left alone.
+static bool AddCalls(concurrent_intmap* table, uint64_t arg, uint64_t calls, uint64_t limit) {
+    uint64_t count = 0;
+    table->find(arg, count);
+    while (count < limit) {
+        uint64_t next = min(count + calls, limit);
+        if (table->compare_exchange(arg, count, next)) return next == limit;
+    }
+    return false;
+}
+
+// Acts on a (function, argument) pair whose count AddCalls has just taken to the threshold. A pure
+// function's result is remembered at the calling site, while it has room for it, and otherwise the
+// function is specialized on the argument. Returns the specialization if it was compiled on the spot
+// (-sync-spec), and fn otherwise. The site is null for a pair flushed from a thread's CountShard.
+static JITTargetAddress ReachThreshold(FunctionProfile* profile, JITTargetAddress fn, uint64_t arg, concurrent_intmap* table, uint64_t* site) {
+    profile->requested.store(true, memory_order_relaxed);
+    if (profile->memo && site && HasMemoSlot(site)) RequestMemo(site, arg);
+    else if (IsDebugFlag("-no-spec") || !profile->function) table->emplace(arg, 0);
+    else if (IsDebugFlag("-sync-spec")) {
+        JITTargetAddress addr = Specialize({ fn, arg, profile->function, table, ChooseTier(profile) });
+        if (addr) return addr;
+    }
+    // if the queue can't take the request, start counting again
+    else if (!EnqueueCompile({ fn, arg, profile->function, table, ChooseTier(profile) })) table->emplace(arg, 0);
+    return fn;
+}
 
 // Returns the address of the function specialized for the given argument. Has three effects:
 //  1. If the function is specialized on the argument, the count will be an address, numerically
-//     greater than the specialization threshold. Return this address and do not modify the count.
-//  2. If the function is not specialized, but is about to cross the threshold, we specialize the
-//     function with our optimization passes on the input and set the count to the new function's address.
+//     greater than the function's specialization threshold, which is never above THRESHOLD_MAX.
+//     Return this address and do not modify the count.
+//  2. If the function is not specialized, but is about to cross the threshold, we queue a request to
+//     specialize the function on the input and return the normal function address. The count is held at
+//     the threshold while the request is pending, and replaced with the new function's address once the
+//     compile worker finishes.
 //  3. If the function is not specialized, and the count will not exceed the threshold, increment the
-//     count and return the normal function address.
+//     count and return the normal function address. Increments are batched per thread (see CountShard).
+//     With -sample N, call sites only call in for one of every N misses, and each call counts as N.
+//     Calls made before the function is first compiled, which decides its threshold, are not counted.
+// Whenever a specialized address is returned, it is also cached in the calling site's inline cache.
+// With -memo, a site's hot keys for a pure function are remembered in its memo slots rather than
+// specialized, for as long as it has slots left.
+// Functions seeing too many distinct arguments are megamorphic, and are not counted at all until their
+// backoff expires. Profiling only restarts when the compile worker is running, i.e. without -sync-spec.
 // Note that by reusing the count to store the specialized function pointer, we lose the ability to
 // profile functions that are already specialized. However, this allows us to implement all of our
 // lookup tables as simple int-to-int maps, which permits for optimization.
-static uint64_t count;
-extern "C" JITTargetAddress JITResolveCall(JITTargetAddress fn, JITTargetAddress arg, const char* name) {
-    auto it = func_counter.find(fn);
-    intmap* curr_func;
-    if (it == func_counter.end()) {
-        intmap* newmap = new intmap;
-        func_counter.emplace(fn, (uint64_t)newmap);
-        curr_func = newmap;
-    }
-    else curr_func = (intmap*)(*it).second;
-    
-    auto curr_elm = curr_func->find(arg);
+extern "C" JITTargetAddress JITResolveCall(JITTargetAddress fn, JITTargetAddress arg, uint64_t id, uint64_t* site) {
+    FunctionProfile* profile = &profiles[id];
+    if (code_budget) Quiesce();
+    CountDispatch(id, DISPATCH_CALLS);
+    // a result another site remembered answers this site's next call, if it has room for it
+    uint64_t result;
+    if (profile->memo && site && profile->memo->find(arg, result) && FillMemoCache(site, arg, result)) return fn;
+    if (profile->megamorphic.load(memory_order_acquire)) {
+        CountDispatch(id, DISPATCH_MEGAMORPHIC);
+        SetFallback(profile, site, fn);
+        return fn;
+    }
+    concurrent_intmap* curr_func = profile->args.load(memory_order_acquire);
+    // Decided when the function is first compiled, which its first call waits for, and calls made
+    // before then are not counted, so counts never exceed it.
+    uint64_t threshold = profile->threshold.load(memory_order_acquire);
+    if (!threshold) return fn;
     
-    uint64_t num_calls;
-    if (curr_elm == curr_func->end()) {
-        num_calls = 1;
-    } else {
-        // if optimized, run that instead
-        if ((*curr_elm).second > SPECIALIZATION_THRESHOLD) {
-            return (*curr_elm).second;
+    uint64_t num_calls = 0;
+    curr_func->find(arg, num_calls);
+    // if optimized, run that instead
+    if (num_calls > threshold) {
+        CountDispatch(id, DISPATCH_HITS);
+        FillInlineCache(site, arg, num_calls);
+        return num_calls;
+    }
+    // specialization or memoization already requested
+    if (num_calls == threshold) {
+        if (profile->memo && site && HasMemoSlot(site)) RequestMemo(site, arg);
+        return fn;
+    }
+
+    CountShard& shard = shards[(((uint64_t)curr_func ^ arg) * 0x9e3779b97f4a7c15ul >> 32) % COUNT_SHARDS];
+    if (shard.table != curr_func || shard.arg != arg) {
+        // Pairs that share a shard flush each other's partial batches, so a flush has to be able to reach
+        // the threshold too, or two hot pairs that alternate would never be specialized.
+        if (shard.table && FlushShard(shard)) ReachThreshold(shard.profile, shard.fn, shard.arg, shard.table, nullptr);
+        shard = { profile, curr_func, fn, arg, 0 };
+        // a new argument for this thread; check whether the function has seen too many
+        if (!profile->requested.load(memory_order_relaxed) && curr_func->size() > MEGAMORPHIC_LIMIT) {
+            MarkMegamorphic(profile, profile->function);
+            CountDispatch(id, DISPATCH_MEGAMORPHIC);
+            SetFallback(profile, site, fn);
+            return fn;
         }
-        num_calls = (*curr_elm).second + 1;
     }
+    // a sampled call stands for all the calls the site skipped since the last sample
+    shard.count += sample_period && site ? sample_period : 1;
+    if (shard.count < min(COUNT_BATCH, threshold)) return fn;
+    uint64_t calls = shard.count;
+    shard.count = 0;
+    profile->calls.fetch_add(calls, memory_order_relaxed);
 
     // param used a lot, optimize it and use it
-    if (num_calls >= SPECIALIZATION_THRESHOLD) {
-        if (IsDebugFlag("-no-spec")) num_calls = 0;
-        else {
-            auto it = function_ir.find(name);
-            if (it != function_ir.end()) {
-                num_calls = fn = CompileFunction(function_ir[name], arg);
-                if (!fn) {
-                    DYLIB->dump(errs());
-                    errs() << "Failed to compile function!\n";
-                }
-            }
+    if (!AddCalls(curr_func, arg, calls, threshold)) return fn;
+    JITTargetAddress addr = ReachThreshold(profile, fn, arg, curr_func, site);
+    if (addr != fn) {
+        CountDispatch(id, DISPATCH_HITS);
+        FillInlineCache(site, arg, addr);
+    }
+    return addr;
+}
+
+extern "C" void JITMemoize(uint64_t id, uint64_t key, uint64_t result, uint64_t* site) {
+    FunctionProfile* profile = &profiles[id];
+    __atomic_store_n(site + MEMO_REQUEST, 0, __ATOMIC_RELAXED);
+    if (profile->memo->size() < MEMO_LIMIT) profile->memo->emplace(key, result);
+    FillMemoCache(site, key, result);
+    // This site no longer calls with the key. Other sites count it again, to remember it in turn or,
+    // once they are out of memo slots, to specialize it.
+    uint64_t expected = profile->threshold.load(memory_order_relaxed);
+    profile->args.load(memory_order_acquire)->compare_exchange(key, expected, 0);
+}
+
+extern "C" void JITRequestOSR(uint64_t id, uint64_t loop, uint64_t* slot) {
+    FunctionProfile* profile = &profiles[id];
+    if (IsDebugFlag("-no-spec") || !profile->function) return;
+    CompileRequest req = { 0, 0, profile->function, nullptr, max_tier };
+    req.osr = slot;
+    req.loop = loop;
+    if (IsDebugFlag("-sync-spec")) {
+        SpecializeOSR(req);
+        return;
+    }
+    // a dropped request is not retried; the loop only reaches the threshold once
+    lock_guard<mutex> lock(queue_lock);
+    if (stopping || compile_queue.size() >= COMPILE_QUEUE_DEPTH) return;
+    compile_queue.push_back(req);
+    queue_ready.notify_one();
+}
+
+extern "C" void JITProfileTarget(uint64_t id, uint64_t index, uint64_t target, uint64_t* site) {
+    FunctionProfile* profile = &profiles[id];
+    lock_guard<mutex> lock(ic_lock);
+    profile->target_sites.emplace(index, site);
+    // Claims are made under the lock, so a target holds at most one slot. The count is written before
+    // the target, so a site that matches the target only ever adds to a count that has been started.
+    for (unsigned i = 0; i < VALUE_PROFILE_SLOTS; i ++) {
+        uint64_t claimed = __atomic_load_n(site + 2 * i, __ATOMIC_RELAXED);
+        if (claimed == target) {
+            __atomic_fetch_add(site + 2 * i + 1, 1, __ATOMIC_RELAXED);
+            return;
         }
+        if (claimed) continue;
+        __atomic_store_n(site + 2 * i + 1, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(site + 2 * i, target, __ATOMIC_RELEASE);
+        return;
     }
-    
-    curr_func->emplace(arg, num_calls);
-    
-    return fn;
+    __atomic_fetch_add(site + 2 * VALUE_PROFILE_SLOTS, 1, __ATOMIC_RELAXED);
 }
 
 // Adds JIT implementation functions to a module.
 void DeclareInternalFunctions(llvm::LLVMContext& ctx, Module* module) {
     Function::Create(
-        FunctionType::get(Type::getInt64Ty(ctx), { Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), Type::getInt8PtrTy(ctx) }, false), 
+        FunctionType::get(Type::getInt64Ty(ctx), { Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), PointerType::get(Type::getInt64Ty(ctx), 0) }, false), 
         Function::ExternalLinkage, 
         "JITResolveCall", 
         module
     );
+    Function::Create(
+        FunctionType::get(Type::getVoidTy(ctx), { Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), PointerType::get(Type::getInt64Ty(ctx), 0) }, false),
+        Function::ExternalLinkage,
+        "JITMemoize",
+        module
+    );
+    Function::Create(
+        FunctionType::get(Type::getVoidTy(ctx), { Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), PointerType::get(Type::getInt64Ty(ctx), 0) }, false),
+        Function::ExternalLinkage,
+        "JITRequestOSR",
+        module
+    );
+    Function::Create(
+        FunctionType::get(Type::getVoidTy(ctx), { Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), Type::getInt64Ty(ctx), PointerType::get(Type::getInt64Ty(ctx), 0) }, false),
+        Function::ExternalLinkage,
+        "JITProfileTarget",
+        module
+    );
 }
 
-static MangleAndInterner* MANGLE = nullptr;
-
 // Adds JIT implementation functions to dynamic linker.
 void AddInternalFunctions(MangleAndInterner& mangle, SymbolMap& map) {
     MANGLE = &mangle;
     map[mangle("JITResolveCall")] = JITEvaluatedSymbol(pointerToJITTargetAddress(&JITResolveCall), {});
+    map[mangle("JITMemoize")] = JITEvaluatedSymbol(pointerToJITTargetAddress(&JITMemoize), {});
+    map[mangle("JITRequestOSR")] = JITEvaluatedSymbol(pointerToJITTargetAddress(&JITRequestOSR), {});
+    map[mangle("JITProfileTarget")] = JITEvaluatedSymbol(pointerToJITTargetAddress(&JITProfileTarget), {});
+    // the guest's threads are tracked for freeing evicted code
+    map[mangle("pthread_create")] = JITEvaluatedSymbol(pointerToJITTargetAddress(&JITCreateThread), {});
+    map[mangle("pthread_join")] = JITEvaluatedSymbol(pointerToJITTargetAddress(&JITJoinThread), {});
 }
 
-int findSpecializedArg(Function* fn) {
-    FunctionType* type = fn->getFunctionType();
-    int i = 0;
-    for (Type* argt : type->params()) {
-        if (isa<IntegerType>(argt) && ((IntegerType*)argt)->getScalarSizeInBits() <= 64) // less than or equal to word size
-            return i;
-        i ++;
+// Returns the indices of the parameters a function is specialized on, in order. Parameters are taken
+// as long as their combined width fits in a word, so that the values of all of them can be packed
+// losslessly into a single 64-bit key. Integers are taken first, and floating-point and pointer
+// parameters only with the room left: a pointer is usually to data that varies from call to call,
+// as in f(int* p, int n), where keying on p would cost the specialization on n. Pointers to copies
+// the caller makes for the call are skipped, since their address is different every time.
+SmallVector<unsigned, 4> findSpecializedArgs(Function* fn) {
+    SmallVector<unsigned, 4> indices;
+    unsigned bits = 0;
+    for (bool integers : { true, false }) {
+        for (Argument& arg : fn->args()) {
+            unsigned argbits = keyBits(arg.getType());
+            if (!argbits || arg.getType()->isIntegerTy() != integers) continue;
+            if (arg.hasByValAttr() || arg.hasInAllocaAttr() || arg.hasStructRetAttr()) continue;
+            if (bits + argbits <= 64) { // less than or equal to word size
+                indices.push_back(arg.getArgNo());
+                bits += argbits;
+            }
+        }
     }
-    return -1;
+    llvm::sort(indices);
+    return indices;
 }
 
 static IRTransformLayer* SPECIALIZE_TRANSFORM = nullptr;
 static ThreadSafeContext CTX;
+static SpecializationCache* OBJECT_CACHE = nullptr;
+// Specialized modules are optimized and compiled in these contexts rather than CTX, which is held
+// by every compile that reads the source module. One per -jobs thread, handed out in turn.
+static vector<ThreadSafeContext> context_pool;
+static atomic<unsigned> next_context(0);
 
-void InitSpecializer(JITDylib* dylib, IRTransformLayer* tl, ThreadSafeContext ctx) {
+void InitSpecializer(JITDylib* dylib, IRTransformLayer* tl, ThreadSafeContext ctx, SpecializationCache* cache) {
+    static bool registered = false;
     DYLIB = dylib;
     CTX = ctx;
-    SPECIALIZE = new SpecializationPass();
+    OBJECT_CACHE = cache;
     SPECIALIZE_TRANSFORM = tl;
+    uint64_t budget = 0, period = 0;
+    if (!GetFlagValue("-code-budget").getAsInteger(10, budget)) code_budget = budget << 10;
+    if (!GetFlagValue("-sample").getAsInteger(10, period) && period > 1) sample_period = period;
+    unsigned tier;
+    if (!GetFlagValue("-base-tier").getAsInteger(10, tier)) base_tier = min(tier, 1u);
+    if (!GetFlagValue("-max-tier").getAsInteger(10, tier)) max_tier = max(min(tier, 2u), 1u);
+    uint64_t batch = 0;
+    if (!GetFlagValue("-batch").getAsInteger(10, batch) && batch > 0) batch_size = batch;
+    uint64_t threshold = 0;
+    if (!GetFlagValue("-threshold").getAsInteger(10, threshold) && threshold > 0) threshold_override = min(threshold, THRESHOLD_MAX);
+    // Code memory is tracked per object, so each specialization needs its own to be evicted alone.
+    if (code_budget) batch_size = 1;
+    unsigned jobs = 0;
+    GetFlagValue("-jobs").getAsInteger(10, jobs);
+    while (context_pool.size() < max(jobs, 1u)) context_pool.push_back(ThreadSafeContext(std::make_unique<LLVMContext>()));
+    stats_enabled = IsDebugFlag("-stats") || !GetFlagValue("-stats-json").empty();
+    if (!registered) {
+        registered = true;
+        atexit(ShutdownSpecializer);
+        if (stats_enabled) {
+            // Specialized code counts its calls into the profile of the function it came from.
+            SymbolMap counters;
+            for (FunctionProfile& profile : profiles)
+                if (profile.function && !profile.function->isDeclaration())
+                    counters[(*MANGLE)(profile.name + ".stats")] = JITEvaluatedSymbol(pointerToJITTargetAddress(&profile.specialized_calls), JITSymbolFlags::Exported);
+            cantFail(DYLIB->define(absoluteSymbols(std::move(counters))));
+            signal(SIGUSR1, [](int) { stats_requested.store(true, memory_order_relaxed); });
+        }
+    }
+    // the guest's main thread runs on this one
+    Quiesce();
+    if (!IsDebugFlag("-sync-spec") && !worker.joinable()) worker = thread(CompileWorker);
 }
 
-llvm::Expected<llvm::orc::ThreadSafeModule> specializeModule(llvm::orc::ThreadSafeModule M, const llvm::orc::MaterializationResponsibility &R) {
-    auto FPM = std::make_unique<legacy::FunctionPassManager>(M.getModuleUnlocked());
+void ShutdownSpecializer() {
+    {
+        lock_guard<mutex> lock(queue_lock);
+        if (stopping) return;
+        stopping = true;
+        compile_queue.clear();
+    }
+    queue_ready.notify_all();
+    if (worker.joinable()) worker.join();
+    if (IsDebugFlag("-log-tiers")) LogTiers(outs());
+    if (stats_enabled) ReportStats();
+    
+    StringRef profile = GetFlagValue("-profile-out");
+    if (profile.empty()) return;
+    // Counts batched by other threads are lost, but this thread's are still available.
+    for (CountShard& shard : shards)
+        if (shard.table) FlushShard(shard, true);
+    if (!SaveProfile(profile)) errs() << "Failed to write profile to " << profile << "\n";
+}
+
+// Profiles are text, one line per (function, argument) pair: the function name, the packed argument
+// key, the number of calls seen, and the function's threshold. Specialized and pending pairs are written
+// with their count at the threshold.
+bool SaveProfile(StringRef path) {
+    error_code ec;
+    raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+    if (ec) return false;
+    for (FunctionProfile& profile : profiles) {
+        // keys holding addresses mean nothing to another run
+        Function* function = profile.function;
+        if (function && any_of(findSpecializedArgs(function), [&](unsigned idx) { return function->getArg(idx)->getType()->isPointerTy(); }))
+            continue;
+        concurrent_intmap* table = profile.args.load(memory_order_acquire);
+        uint64_t threshold = profile.threshold.load(memory_order_relaxed);
+        for (auto it = table->begin(); it != table->end(); ++ it) {
+            uint64_t count = min((uint64_t)(*it).second, threshold);
+            if (count) out << profile.name << " " << (*it).first << " " << count << " " << threshold << "\n";
+        }
+    }
+    return !out.has_error();
+}
+
+bool LoadProfile(StringRef path, function_ref<JITTargetAddress(StringRef)> lookup) {
+    auto buffer = MemoryBuffer::getFile(path);
+    if (!buffer) return false;
+    // Hot entries are compiled in batches, as the worker would, and held at the threshold until then.
+    vector<CompileRequest> batch;
+    auto flush = [&] {
+        if (!batch.empty()) SpecializeBatch(batch);
+        batch.clear();
+    };
+    for (line_iterator line(**buffer); !line.is_at_end(); ++ line) {
+        // the threshold field is informational, and absent from older profiles
+        SmallVector<StringRef, 4> fields;
+        line->split(fields, ' ', -1, false);
+        uint64_t arg, count;
+        if ((fields.size() != 3 && fields.size() != 4) || fields[1].getAsInteger(10, arg) || fields[2].getAsInteger(10, count)) {
+            errs() << path << ":" << line.line_number() << ": malformed profile entry\n";
+            continue;
+        }
+        // the program may have changed since the profile was written
+        FunctionProfile* profile = FindProfile(fields[0]);
+        if (!profile || !profile->function) continue;
+        JITTargetAddress fn = lookup(fields[0]);
+        if (!fn) continue;
+
+        // The count is compared against this run's threshold, which may differ from the one it was
+        // written under, if the function or the -threshold flag has changed.
+        uint64_t threshold = profile->threshold.load(memory_order_acquire);
+        if (!threshold) {
+            auto lock = CTX.getLock();
+            LoadSourceBody(profile->function);
+            threshold = ChooseThreshold(profile, profile->function);
+        }
+        concurrent_intmap* table = profile->args.load(memory_order_acquire);
+        uint64_t current = 0;
+        if (table->find(arg, current) && current >= threshold) continue;
+        if (count < threshold || IsDebugFlag("-no-spec")) {
+            table->emplace(arg, min(current + count, threshold - 1));
+            continue;
+        }
+        profile->requested.store(true, memory_order_relaxed);
+        table->emplace(arg, threshold);
+        batch.push_back({ fn, arg, profile->function, table, max_tier });
+        if (batch.size() >= batch_size) flush();
+    }
+    flush();
+    return true;
+}
+
+static Function* CloneIntoModule(Module* module, Function* function, StringRef name, SmallVectorImpl<ReturnInst*>& returns);
+static bool HasSourceBody(Function* function);
+
+unsigned GetBaseTier() {
+    return base_tier;
+}
+
+unsigned GetModuleTier(const Module& m) {
+    if (ConstantInt* tier = mdconst::extract_or_null<ConstantInt>(m.getModuleFlag(TIER_MD))) return tier->getZExtValue();
+    return base_tier;
+}
+
+// Modules, optimization time, code generation time, object bytes and specializations, per tier.
+static atomic<uint64_t> tier_stats[TIER_COUNT][5];
+
+void RecordOptimization(unsigned tier, uint64_t ns) {
+    tier_stats[tier][1] += ns;
+}
+
+void RecordCodegen(unsigned tier, uint64_t ns, uint64_t bytes) {
+    tier_stats[tier][0] ++;
+    tier_stats[tier][2] += ns;
+    tier_stats[tier][3] += bytes;
+}
+
+// Counts specialized functions compiled at a tier. Batches put several in one module.
+static void RecordSpecializations(unsigned tier, uint64_t count) {
+    tier_stats[tier][4] += count;
+}
+
+void LogTiers(raw_ostream& io) {
+    for (unsigned tier = 0; tier < TIER_COUNT; tier ++) {
+        uint64_t modules = tier_stats[tier][0];
+        io << "tier " << tier << ": " << modules << " modules, "
+           << format("%.3f", tier_stats[tier][1] / 1e6) << " ms optimizing, "
+           << format("%.3f", tier_stats[tier][2] / 1e6) << " ms generating code, "
+           << tier_stats[tier][3] << " bytes of object code";
+        uint64_t specializations = tier_stats[tier][4];
+        if (specializations) io << ", " << specializations << " specializations at "
+           << format("%.3f", (tier_stats[tier][1] + tier_stats[tier][2]) / 1e6 / specializations) << " ms each";
+        io << "\n";
+    }
+}
+
+// Writes per-function stats: to stderr as a table with -stats, and to a file as JSON with -stats-json.
+// Called by the compile worker, or once it has stopped, since it reads argument tables that only the
+// worker frees.
+static void ReportStats() {
+    vector<array<uint64_t, DISPATCH_COUNTERS>> dispatch(profiles.size());
+    {
+        lock_guard<mutex> lock(dispatch_lock);
+        for (atomic<uint64_t>* counts : dispatch_counts)
+            for (size_t id = 0; id < profiles.size(); id ++)
+                for (unsigned i = 0; i < DISPATCH_COUNTERS; i ++)
+                    dispatch[id][i] += counts[id * DISPATCH_COUNTERS + i].load(memory_order_relaxed);
+    }
+
+    error_code ec;
+    std::unique_ptr<raw_fd_ostream> json_file;
+    StringRef json_path = GetFlagValue("-stats-json");
+    if (!json_path.empty()) {
+        json_file = std::make_unique<raw_fd_ostream>(json_path, ec, sys::fs::OF_Text);
+        if (ec) {
+            errs() << "Failed to write stats to " << json_path << ": " << ec.message() << "\n";
+            json_file.reset();
+        }
+    }
+    bool table = IsDebugFlag("-stats");
+    if (table) errs() << "function                      runtime         hits  megamorphic  specialized threshold     args   load  probe   max  specs compile ms code bytes\n";
+
+    json::OStream json(json_file ? *json_file : nulls(), 2);
+    json.objectBegin();
+    json.attributeBegin("functions");
+    json.arrayBegin();
+    for (size_t id = 0; id < profiles.size(); id ++) {
+        const FunctionProfile& profile = profiles[id];
+        const concurrent_intmap* args = profile.args.load(memory_order_acquire);
+        uint64_t specializations = profile.specializations.load(memory_order_relaxed);
+        if (!dispatch[id][DISPATCH_CALLS] && !specializations && !args->size()) continue;
+        uint64_t probes;
+        uint32_t longest;
+        args->probe_lengths(probes, longest);
+        double load = (double)args->size() / args->capacity();
+        double mean_probe = args->size() ? (double)probes / args->size() : 0;
+        double compile_ms = profile.compile_ns.load(memory_order_relaxed) / 1e6;
+        if (table) errs() << format("%-24s %12lu %12lu %12lu %12lu %9lu %8u %6.2f %6.2f %5u %6lu %10.3f %10lu\n",
+            profile.name.c_str(), dispatch[id][DISPATCH_CALLS], dispatch[id][DISPATCH_HITS], dispatch[id][DISPATCH_MEGAMORPHIC],
+            profile.specialized_calls.load(memory_order_relaxed), profile.threshold.load(memory_order_relaxed), args->size(), load, mean_probe, longest,
+            specializations, compile_ms, profile.code_bytes.load(memory_order_relaxed));
+        json.object([&] {
+            json.attribute("name", profile.name);
+            json.attribute("runtime_calls", (int64_t)dispatch[id][DISPATCH_CALLS]);
+            json.attribute("runtime_hits", (int64_t)dispatch[id][DISPATCH_HITS]);
+            json.attribute("megamorphic_calls", (int64_t)dispatch[id][DISPATCH_MEGAMORPHIC]);
+            json.attribute("specialized_calls", (int64_t)profile.specialized_calls.load(memory_order_relaxed));
+            json.attribute("threshold", (int64_t)profile.threshold.load(memory_order_relaxed));
+            json.attribute("distinct_args", (int64_t)args->size());
+            json.attribute("table_capacity", (int64_t)args->capacity());
+            json.attribute("load_factor", load);
+            json.attribute("mean_probe", mean_probe);
+            json.attribute("max_probe", (int64_t)longest);
+            json.attribute("specializations", (int64_t)specializations);
+            json.attribute("compile_ms", compile_ms);
+            json.attribute("code_bytes", (int64_t)profile.code_bytes.load(memory_order_relaxed));
+        });
+    }
+    json.arrayEnd();
+    json.attributeEnd();
+    json.attributeArray("tiers", [&] {
+        for (unsigned tier = 0; tier < TIER_COUNT; tier ++) {
+            json.object([&] {
+                json.attribute("tier", (int64_t)tier);
+                json.attribute("modules", (int64_t)tier_stats[tier][0]);
+                json.attribute("optimize_ms", tier_stats[tier][1] / 1e6);
+                json.attribute("codegen_ms", tier_stats[tier][2] / 1e6);
+                json.attribute("object_bytes", (int64_t)tier_stats[tier][3]);
+                json.attribute("specializations", (int64_t)tier_stats[tier][4]);
+            });
+        }
+    });
+    json.objectEnd();
+    if (table) LogTiers(errs());
+}
+
+// Folds loads from constant addresses in read-only data. Returns true if any were folded.
+static bool foldImmutableLoads(Function& f) {
+    Module& m = *f.getParent();
+    const DataLayout& DL = m.getDataLayout();
+    bool changed = false;
+    for (BasicBlock& bb : f) {
+        for (auto it = bb.begin(); it != bb.end(); ) {
+            LoadInst* load = dyn_cast<LoadInst>(&*it ++);
+            if (!load || load->isVolatile()) continue;
+            Type* t = load->getType();
+            unsigned bits = keyBits(t);
+            if (!bits || bits > 64) continue;
+            Value* ptr = load->getPointerOperand();
+            APInt offset(DL.getIndexTypeSizeInBits(ptr->getType()), 0);
+            ConstantExpr* cast = dyn_cast<ConstantExpr>(ptr->stripAndAccumulateConstantOffsets(DL, offset, true));
+            ConstantInt* base = cast && cast->getOpcode() == Instruction::IntToPtr ? dyn_cast<ConstantInt>(cast->getOperand(0)) : nullptr;
+            if (!base) continue;
+            uint64_t value = 0; // the host is little-endian, so the loaded bytes land in the low bits
+            if (!ReadImmutable(base->getZExtValue() + offset.getSExtValue(), DL.getTypeStoreSize(t), &value)) continue;
+            Constant* folded = ConstantInt::get(f.getContext(), APInt(bits, value));
+            if (t->isPointerTy()) folded = ConstantExpr::getIntToPtr(folded, t);
+            else if (t->isFloatingPointTy()) folded = ConstantExpr::getBitCast(folded, t);
+            load->replaceAllUsesWith(folded);
+            load->eraseFromParent();
+            changed = true;
+        }
+    }
+    if (changed && !m.getModuleFlag(UNCACHED_MD)) m.addModuleFlag(Module::Warning, UNCACHED_MD, 1);
+    return changed;
+}
+
+// Folds immutable loads in the tier 2 pipeline, after each round of peephole optimizations, so that
+// loads whose addresses only become constant once loops are unrolled are folded too.
+struct ImmutableLoadFolding : PassInfoMixin<ImmutableLoadFolding> {
+    PreservedAnalyses run(Function& f, FunctionAnalysisManager&) {
+        return foldImmutableLoads(f) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+};
+
+// Runs the new pass manager's default O2 pipeline over a module, or O3 with -O3. The target machine
+// is only used for cost modelling, so one is shared, under its own lock now that modules in different
+// contexts can be optimized at once.
+static void runTier2Pipeline(Module& m) {
+    static std::unique_ptr<TargetMachine> TM;
+    static mutex TM_lock;
+    lock_guard<mutex> lock(TM_lock);
+    if (!TM) {
+        auto JTMB = JITTargetMachineBuilder::detectHost();
+        if (JTMB) {
+            auto created = JTMB->createTargetMachine();
+            if (created) TM = std::move(*created);
+            else consumeError(created.takeError());
+        }
+        else consumeError(JTMB.takeError());
+    }
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM.get());
+    FAM.registerPass([&] { return PB.buildDefaultAAPipeline(); });
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PB.registerPeepholeEPCallback([](FunctionPassManager& FPM, PassBuilder::OptimizationLevel) {
+        FPM.addPass(ImmutableLoadFolding());
+    });
+    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(
+        IsDebugFlag("-O3") ? PassBuilder::OptimizationLevel::O3 : PassBuilder::OptimizationLevel::O2);
+    MPM.run(m, MAM);
+}
+
+// Returns the key a call's specialized arguments pack into, if all of them are constants. Pointers
+// only count as constants once they are a known address: null, or one SpecializationPass folded in.
+// The addresses of globals are not known until they are linked.
+static Optional<uint64_t> constantKey(CallInst* call, Function* callee) {
+    uint64_t key = 0;
+    unsigned offset = 0;
+    for (unsigned idx : findSpecializedArgs(callee)) {
+        Value* arg = call->getArgOperand(idx);
+        uint64_t value;
+        if (ConstantInt* i = dyn_cast<ConstantInt>(arg)) value = i->getZExtValue();
+        else if (ConstantFP* fp = dyn_cast<ConstantFP>(arg)) value = fp->getValueAPF().bitcastToAPInt().getZExtValue();
+        else if (isa<ConstantPointerNull>(arg)) value = 0;
+        else {
+            ConstantExpr* cast = dyn_cast<ConstantExpr>(arg);
+            ConstantInt* addr = cast && cast->getOpcode() == Instruction::IntToPtr ? dyn_cast<ConstantInt>(cast->getOperand(0)) : nullptr;
+            if (!addr) return None;
+            value = addr->getZExtValue();
+        }
+        unsigned bits = keyBits(arg->getType());
+        key |= (bits == 64 ? value : value & ((1ul << bits) - 1)) << offset;
+        offset += bits;
+    }
+    return key;
+}
+
+// Returns the source function whose generic code guest code calls at an address: the address of its
+// symbol in the dylib, which is what function pointers to it hold. Every tracked function with a body
+// is looked up at once, the first time, since none are added once guest code runs. Looking a function
+// up only makes its stub, not its code. Must hold the source context's lock.
+static unordered_map<JITTargetAddress, Function*> function_addresses;
+static bool function_addresses_known = false;
+
+static Function* FunctionAt(JITTargetAddress addr) {
+    if (!function_addresses_known) {
+        function_addresses_known = true;
+        SymbolLookupSet syms;
+        DenseMap<SymbolStringPtr, Function*> functions;
+        for (FunctionProfile& profile : profiles) {
+            if (!profile.function || !HasSourceBody(profile.function)) continue;
+            SymbolStringPtr sym = (*MANGLE)(profile.name);
+            syms.add(sym, SymbolLookupFlags::WeaklyReferencedSymbol);
+            functions[sym] = profile.function;
+        }
+        auto result = DYLIB->getExecutionSession().lookup(makeJITDylibSearchOrder(DYLIB), std::move(syms));
+        if (!result) logAllUnhandledErrors(result.takeError(), errs(), "Failed to look up indirect call targets: ");
+        else for (auto& entry : *result) function_addresses[entry.second.getAddress()] = functions[entry.first];
+    }
+    auto it = function_addresses.find(addr);
+    return it == function_addresses.end() ? nullptr : it->second;
+}
+
+// Speculatively devirtualizes the indirect calls in a clone that have value profiles, calling up to
+// DEVIRT_TARGETS of their targets directly behind a check of the pointer, hottest first. A target has
+// to have taken DEVIRT_PERCENT of the site's calls, and have been called at least its own threshold times.
+// Calls to any other target still go through the pointer. The direct calls are then resolved like any
+// other by specializeCalls. A cached object keeps the targets it was compiled with, which is safe, since
+// the checks are against the targets' symbols. Returns true if any calls were devirtualized. Must hold
+// the source context's lock.
+static bool devirtualizeCalls(Function& f) {
+    if (IsDebugFlag("-no-devirt")) return false;
+    std::vector<CallInst*> calls;
+    for (auto& bb : f)
+        for (auto& inst : bb)
+            if (isa<CallInst>(&inst) && inst.getMetadata(SITE_MD)) calls.push_back(cast<CallInst>(&inst));
+    bool changed = false;
+    for (CallInst* call : calls) {
+        MDNode* md = call->getMetadata(SITE_MD);
+        uint64_t id = mdconst::extract<ConstantInt>(md->getOperand(0))->getZExtValue();
+        uint64_t index = mdconst::extract<ConstantInt>(md->getOperand(1))->getZExtValue();
+        call->setMetadata(SITE_MD, nullptr);
+        if (!call->isIndirectCall()) continue;
+        uint64_t* site = nullptr;
+        {
+            lock_guard<mutex> lock(ic_lock);
+            auto it = profiles[id].target_sites.find(index);
+            if (it != profiles[id].target_sites.end()) site = it->second;
+        }
+        if (!site) continue;
+
+        // The counts keep changing, so read each once.
+        SmallVector<pair<uint64_t, uint64_t>, VALUE_PROFILE_SLOTS> targets; // (count, target)
+        uint64_t total = __atomic_load_n(site + 2 * VALUE_PROFILE_SLOTS, __ATOMIC_RELAXED);
+        for (unsigned i = 0; i < VALUE_PROFILE_SLOTS; i ++) {
+            uint64_t target = __atomic_load_n(site + 2 * i, __ATOMIC_ACQUIRE);
+            if (!target) break;
+            targets.push_back({ __atomic_load_n(site + 2 * i + 1, __ATOMIC_RELAXED), target });
+            total += targets.back().first;
+        }
+        llvm::sort(targets, greater<pair<uint64_t, uint64_t>>());
+
+        unsigned promoted = 0;
+        uint64_t rest = total;
+        uint64_t scale = total / UINT32_MAX + 1; // branch weights are 32 bits
+        for (auto& target : targets) {
+            if (promoted >= DEVIRT_TARGETS || target.first * 100 < total * DEVIRT_PERCENT) break;
+            Function* source = FunctionAt(target.second);
+            if (!source) continue;
+            // the target has been called, so it has been compiled and its threshold decided
+            FunctionProfile* profile = FindProfile(source->getName());
+            uint64_t threshold = profile ? profile->threshold.load(memory_order_acquire) : 0;
+            if (target.first < (threshold ? threshold : SPECIALIZATION_THRESHOLD)) continue;
+            Function* callee = dyn_cast<Function>(f.getParent()->getOrInsertFunction(source->getName(), source->getFunctionType()).getCallee());
+            if (!callee || !isLegalToPromote(*call, callee)) continue;
+            rest -= target.first;
+            MDNode* weights = MDBuilder(f.getContext()).createBranchWeights(target.first / scale, rest / scale);
+            promoteCallWithIfThenElse(*call, callee, weights);
+            promoted ++;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Resolves calls from specialized code to tracked functions at compile time. Calls whose specialized
+// arguments have folded to constants are pointed at a clone of the callee specialized on those
+// constants, which is internal to the module and has its own calls resolved in turn, up to
+// TRANSITIVE_DEPTH calls deep and TRANSITIVE_LIMIT clones per module. Other calls are pointed at a
+// declaration in the module, rather than at the source module's definition. Calls to a pure function
+// whose result for the constants is in its memo table are replaced by the result, at any depth and
+// even with -no-transitive. Returns true if any clones were called. Must hold the source context's lock.
+static bool specializeCalls(Module& m, legacy::FunctionPassManager& FPM) {
+    std::vector<std::pair<Function*, unsigned>> worklist;
+    for (Function& f : m)
+        if (!f.isDeclaration()) worklist.push_back({ &f, 0 });
+    unsigned clones = 0;
+    bool changed = false;
+    while (!worklist.empty()) {
+        Function* f = worklist.back().first;
+        unsigned depth = worklist.back().second;
+        worklist.pop_back();
+        std::vector<std::pair<CallInst*, uint64_t>> remembered;
+        for (auto& bb : *f) {
+            for (auto& inst : bb) {
+                CallInst* call = dyn_cast<CallInst>(&inst);
+                if (!call || !call->getCalledFunction() || !call->getCalledFunction()->isDeclaration()) continue;
+                Function* callee = call->getCalledFunction();
+
+                FunctionProfile* profile = FindProfile(callee->getName());
+                if (!profile || !profile->function || !HasSourceBody(profile->function)
+                    || findSpecializedArgs(profile->function).empty()) continue;
+                Optional<uint64_t> key = constantKey(call, profile->function);
+                if (!key) continue;
+                // a pure call whose result is remembered is replaced by the result
+                uint64_t result;
+                if (profile->memo && profile->memo->find(*key, result)) {
+                    remembered.push_back({ call, result });
+                    continue;
+                }
+                if (depth >= TRANSITIVE_DEPTH || IsDebugFlag("-no-transitive")) continue;
+                std::string name = SpecializedName(profile->function, *key);
+                Function* clone = m.getFunction(name);
+                if (!clone) {
+                    if (clones >= TRANSITIVE_LIMIT) continue;
+                    SmallVector<ReturnInst*, 8> returns;
+                    clone = CloneIntoModule(&m, profile->function, name, returns);
+                    clone->setLinkage(GlobalValue::InternalLinkage);
+                    LLVMContext& ctx = clone->getContext();
+                    clone->setMetadata(SPECIALIZATION_MD, MDNode::get(ctx, ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(ctx), *key))));
+                    devirtualizeCalls(*clone);
+                    FPM.run(*clone);
+                    worklist.push_back({ clone, depth + 1 });
+                    clones ++;
+                }
+                if (clone->getFunctionType() != call->getFunctionType()) continue;
+                call->setCalledFunction(clone);
+                changed = true;
+            }
+        }
+        for (auto& call : remembered) {
+            call.first->replaceAllUsesWith(ConstantInt::get(call.first->getType(), call.second));
+            call.first->eraseFromParent();
+        }
+    }
+    return changed;
+}
+
+// Runs the tier 1 passes over a specialized module, and resolves its calls to clones. Both need the
+// source module, so they run on the compile worker under the source context's lock, before the
+// module is moved to a context of its own. A cached object will be loaded by the compile layer in
+// place of the module, so there is no point optimizing it.
+static void prepareSpecializedModule(Module& m) {
+    if (OBJECT_CACHE && OBJECT_CACHE->hasObject(&m)) return;
+    auto start = chrono::steady_clock::now();
+    // Devirtualize first, while the calls still have the tags they were cloned with.
+    for (auto& F : m) devirtualizeCalls(F);
+    auto FPM = std::make_unique<legacy::FunctionPassManager>(&m);
     FPM->add(new SpecializationPass());
     FPM->add(createInstructionCombiningPass());
+    FPM->add(createCorrelatedValuePropagationPass());
     FPM->add(createReassociatePass());
     FPM->add(createGVNPass());
     FPM->add(createCFGSimplificationPass());
     FPM->add(createPromoteMemoryToRegisterPass());
     FPM->add(createConstantPropagationPass());
+    FPM->add(new ImmutableLoadPass());
+    FPM->add(createConstantPropagationPass());
     FPM->add(createDeadCodeEliminationPass());
     FPM->doInitialization();
-    for (auto &F : *M.getModuleUnlocked()) {
+    for (auto &F : m) {
       FPM->run(F);
     }
+    specializeCalls(m, *FPM);
+    RecordOptimization(GetModuleTier(m), chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+// Moves a module into the next context from the pool, by way of bitcode. Returns the module where
+// it was if it cannot be read back. Must hold the source context's lock.
+static ThreadSafeModule moveToPooledContext(ThreadSafeModule tsm) {
+    Module& m = *tsm.getModuleUnlocked();
+    SmallVector<char, 0> buffer;
+    raw_svector_ostream out(buffer);
+    WriteBitcodeToFile(m, out);
+
+    ThreadSafeContext ctx = context_pool[next_context ++ % context_pool.size()];
+    auto lock = ctx.getLock();
+    auto moved = parseBitcodeFile(MemoryBufferRef(StringRef(buffer.data(), buffer.size()), m.getModuleIdentifier()), *ctx.getContext());
+    if (!moved) {
+        logAllUnhandledErrors(moved.takeError(), errs(), "Failed to move " + m.getModuleIdentifier() + " to its own context: ");
+        return tsm;
+    }
+    (*moved)->setModuleIdentifier(m.getModuleIdentifier());
+    return ThreadSafeModule(std::move(*moved), ctx);
+}
+
+// Finishes a specialized module built in the source context, and moves it out of that context.
+// Must hold the source context's lock.
+static ThreadSafeModule DetachSpecializedModule(ThreadSafeModule tsm) {
+    prepareSpecializedModule(*tsm.getModuleUnlocked());
+    return moveToPooledContext(std::move(tsm));
+}
+
+llvm::Expected<llvm::orc::ThreadSafeModule> specializeModule(llvm::orc::ThreadSafeModule M, const llvm::orc::MaterializationResponsibility &R) {
+    // The module is in a context of its own by now, so this only holds up other modules in the
+    // same context from the pool.
+    M.withModuleDo([](Module& m) {
+        if (OBJECT_CACHE && OBJECT_CACHE->hasObject(&m)) return;
+        unsigned tier = GetModuleTier(m);
+        auto start = chrono::steady_clock::now();
+
+        // Once calls within the module reach clones with constant arguments, constant returns can be
+        // propagated back through them, and what is left is small enough to inline. Clones are the
+        // only functions in the module with internal linkage.
+        if (any_of(m, [](Function& f) { return f.hasInternalLinkage(); })) {
+            legacy::PassManager MPM;
+            MPM.add(createIPSCCPPass());
+            MPM.add(createFunctionInliningPass());
+            MPM.add(createGlobalDCEPass());
+            MPM.add(createInstructionCombiningPass());
+            MPM.add(createCFGSimplificationPass());
+            MPM.run(m);
+        }
+        if (tier >= 2) runTier2Pipeline(m);
+        RecordOptimization(tier, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    });
 
     return M;
 }
 
+// Materializes a module of one or more specialized functions.
 class SpecializationMaterializer : public MaterializationUnit {
     ThreadSafeModule tsm;
-    JITTargetAddress arg;
     std::string name;
 
-    static SymbolFlagsMap getSymbolMap(SymbolStringPtr name) {
+    static SymbolFlagsMap getSymbolMap(ArrayRef<SymbolStringPtr> syms) {
         SymbolFlagsMap map;
-        map.insert({name, JITSymbolFlags::Exported | JITSymbolFlags::Callable});
+        for (const SymbolStringPtr& sym : syms)
+            map.insert({sym, JITSymbolFlags::Exported | JITSymbolFlags::Callable});
         return map;
     }
 public:
-    SpecializationMaterializer(SymbolStringPtr sym, ThreadSafeModule&& tsm_in, JITTargetAddress arg_in): 
-        MaterializationUnit(getSymbolMap(sym), sym, 0), tsm(move(tsm_in)), arg(arg_in) {
-        name = "Materializer_" + std::string(*sym);
+    SpecializationMaterializer(ArrayRef<SymbolStringPtr> syms, ThreadSafeModule&& tsm_in): 
+        MaterializationUnit(getSymbolMap(syms), syms[0], 0), tsm(move(tsm_in)) {
+        name = "Materializer_" + std::string(*syms[0]);
+        if (syms.size() > 1) name += "_and_" + to_string(syms.size() - 1) + "_more";
     } 
     
     StringRef getName() const override {
@@ -185,7 +1551,6 @@ public:
     }
 protected:
     void materialize(MaterializationResponsibility R) override {
-        SPECIALIZE->setValue(arg);
         SPECIALIZE_TRANSFORM->emit(std::move(R), std::move(tsm));
     }
     
@@ -194,18 +1559,130 @@ protected:
     }
 };
 
-// Compiles a function specialized on a particular input.
-JITTargetAddress CompileFunction(Function* function, JITTargetAddress arg) {
-    std::string mangled = function->getName().str() + "_" + to_string((uint64_t)arg);
-    ThreadSafeModule tsm(std::make_unique<Module>(mangled, *CTX.getContext()), CTX);
-    DeclareInternalFunctions(*tsm.getContext().getContext(), tsm.getModuleUnlocked());
-    
+// Points globals referenced by code cloned out of the source module at ones in the clone's module, so
+// that the module stands alone and can be moved to another context. Functions and variables become
+// declarations, linked by name, except for local constants such as string literals, which have no
+// symbol to link against and are copied.
+class SourceGlobalMaterializer : public ValueMaterializer {
+    Module* module;
+public:
+    SourceGlobalMaterializer(Module* module): module(module) {}
+
+    Value* materialize(Value* v) override {
+        GlobalValue* gv = dyn_cast<GlobalValue>(v);
+        if (!gv || gv->getParent() == module) return nullptr;
+        if (Function* f = dyn_cast<Function>(gv))
+            return module->getOrInsertFunction(f->getName(), f->getFunctionType()).getCallee();
+        GlobalVariable* var = dyn_cast<GlobalVariable>(gv);
+        if (!var) return nullptr;
+        if (GlobalVariable* existing = module->getNamedGlobal(var->getName())) return existing;
+        GlobalVariable* copy = new GlobalVariable(*module, var->getValueType(), var->isConstant(),
+            GlobalValue::ExternalLinkage, nullptr, var->getName());
+        if (var->hasLocalLinkage() && var->isConstant() && var->hasInitializer() && isa<ConstantData>(var->getInitializer())) {
+            copy->setLinkage(var->getLinkage());
+            copy->setInitializer(var->getInitializer());
+            copy->setAlignment(var->getAlign());
+            copy->setUnnamedAddr(var->getUnnamedAddr());
+        }
+        return copy;
+    }
+};
+
+// Source function bodies are loaded from bitcode the first time they are cloned. At most SOURCE_BODIES
+// are kept loaded, and the least recently cloned are released beyond that. A released body is loaded
+// again, if it is needed again, by the same bitcode reader, so it comes back with the source module's
+// own types and constants. Guarded by the source context's lock.
+static list<Function*> loaded_bodies; // most recently cloned first
+static unordered_map<Function*, list<Function*>::iterator> loaded_positions;
+
+// Returns true if a source function has a body, loaded or not.
+static bool HasSourceBody(Function* function) {
+    return !function->isDeclaration();
+}
+
+// Releases a loaded source body, leaving the function as it was before the body was first loaded, so
+// that the reader loads it again when it is next materialized. Deleting a body also drops the linkage,
+// personality and prefix and prologue data the reader set when it read the module, so they are put
+// back; its metadata is read again with the body.
+static void ReleaseSourceBody(Function* function) {
+    GlobalValue::LinkageTypes linkage = function->getLinkage();
+    Constant* personality = function->hasPersonalityFn() ? function->getPersonalityFn() : nullptr;
+    Constant* prefix = function->hasPrefixData() ? function->getPrefixData() : nullptr;
+    Constant* prologue = function->hasPrologueData() ? function->getPrologueData() : nullptr;
+    function->deleteBody();
+    function->setIsMaterializable(true);
+    function->setLinkage(linkage);
+    if (personality) function->setPersonalityFn(personality);
+    if (prefix) function->setPrefixData(prefix);
+    if (prologue) function->setPrologueData(prologue);
+}
+
+// Makes sure a source function's body is loaded before it is cloned, and releases the least recently
+// cloned bodies beyond SOURCE_BODIES. Must hold the source context's lock.
+static void LoadSourceBody(Function* function) {
+    auto position = loaded_positions.find(function);
+    if (position != loaded_positions.end()) {
+        loaded_bodies.splice(loaded_bodies.begin(), loaded_bodies, position->second);
+        return;
+    }
+    if (function->isMaterializable()) {
+        if (Error err = function->materialize()) {
+            logAllUnhandledErrors(std::move(err), errs(), "Failed to load " + function->getName() + ": ");
+            return;
+        }
+    }
+    else return; // a declaration
+    loaded_bodies.push_front(function);
+    loaded_positions[function] = loaded_bodies.begin();
+    while (loaded_bodies.size() > SOURCE_BODIES) {
+        Function* oldest = loaded_bodies.back();
+        loaded_bodies.pop_back();
+        loaded_positions.erase(oldest);
+        ReleaseSourceBody(oldest);
+    }
+}
+
+// Tags the indirect calls in a clone of a source function with the function's ID and each call's
+// ordinal among the function's indirect calls, in the order InstrumentationPass numbers their value
+// profiles in, so that devirtualizeCalls can find them. The ordinals are taken from the source, since
+// the clone's calls may no longer look indirect once arguments are mapped to constants.
+static void TagIndirectCalls(Function* function, ValueToValueMapTy& vmap) {
+    auto id = function_ids.find(function->getName().str());
+    if (id == function_ids.end()) return;
+    LLVMContext& ctx = function->getContext();
+    Type* i64 = Type::getInt64Ty(ctx);
+    unsigned index = 0;
+    for (auto& bb : *function) {
+        for (auto& inst : bb) {
+            CallInst* call = dyn_cast<CallInst>(&inst);
+            if (!call || !call->isIndirectCall()) continue;
+            CallInst* copy = dyn_cast_or_null<CallInst>(vmap.lookup(call));
+            MDNode* md = MDNode::get(ctx, { ConstantAsMetadata::get(ConstantInt::get(i64, id->second)),
+                ConstantAsMetadata::get(ConstantInt::get(i64, index ++)) });
+            if (copy) copy->setMetadata(SITE_MD, md);
+        }
+    }
+}
+
+// Lets a clone of a source function be optimized. Unoptimized bitcode marks every function optnone,
+// which every pass skips, and noinline, which optnone requires. A noinline without optnone is the
+// program's own, and is kept.
+static void AllowOptimization(Function* copy) {
+    if (!copy->hasFnAttribute(Attribute::OptimizeNone)) return;
+    copy->removeFnAttr(Attribute::OptimizeNone);
+    copy->removeFnAttr(Attribute::NoInline);
+}
+
+// Clones a function from the source module into a module of its own, under a new name, ready to be
+// optimized.
+static Function* CloneIntoModule(Module* module, Function* function, StringRef name, SmallVectorImpl<ReturnInst*>& returns) {
+    LoadSourceBody(function);
     std::vector<Type*> argts;
     for (const Argument &I : function->args())
       argts.push_back(I.getType());
     FunctionType *fty = FunctionType::get(function->getFunctionType()->getReturnType(),
                                       argts, function->getFunctionType()->isVarArg());
-    Function* copy = Function::Create(fty, Function::ExternalLinkage, mangled, tsm.getModuleUnlocked());
+    Function* copy = Function::Create(fty, Function::ExternalLinkage, name, module);
     ValueToValueMapTy vmap;
     Function::arg_iterator DestI = copy->arg_begin();
     for (const Argument & I : function->args())
@@ -213,18 +1690,29 @@ JITTargetAddress CompileFunction(Function* function, JITTargetAddress arg) {
             DestI->setName(I.getName()); 
             vmap[&I] = &*DestI++;      
         }
-    SmallVector<ReturnInst*, 8> returns;
-    CloneFunctionInto(copy, function, vmap, true, returns);
+    SourceGlobalMaterializer materializer(module);
+    CloneFunctionInto(copy, function, vmap, true, returns, "", nullptr, nullptr, &materializer);
+    TagIndirectCalls(function, vmap);
+    AllowOptimization(copy);
+    return copy;
+}
 
+// Adds a module holding specialized functions to the dylib, and returns the functions' addresses,
+// in order, once they are compiled. All of them are 0 on failure.
+static SmallVector<JITTargetAddress, 8> LinkSpecializations(ArrayRef<std::string> mangled, ThreadSafeModule tsm) {
+    SmallVector<JITTargetAddress, 8> addrs(mangled.size(), 0);
+    SmallVector<SymbolStringPtr, 8> syms;
+    for (const std::string& name : mangled) syms.push_back((*MANGLE)(name));
     ExecutionSession& ES = DYLIB->getExecutionSession();
-    auto def = DYLIB->define(std::make_unique<SpecializationMaterializer>((*MANGLE)(mangled), std::move(tsm), arg));
+    auto def = DYLIB->define(std::make_unique<SpecializationMaterializer>(syms, std::move(tsm)));
     if (def) {
-        errs() << "Failed to define specialized function " << mangled << " in dylib.\n";
+        errs() << "Failed to define specialized function " << mangled[0] << " in dylib.\n";
         ES.reportError(std::move(def));
-        return 0;
+        return addrs;
     }
 
-    auto sym = ES.lookup({DYLIB}, (*MANGLE)(mangled));
+    // One lookup emits the whole module.
+    auto result = ES.lookup(makeJITDylibSearchOrder(DYLIB), SymbolLookupSet(syms));
 
     if (IsDebugFlag("-dumpjd")) {
         outs() << "Dumping JITDylib contents\n";
@@ -232,30 +1720,455 @@ JITTargetAddress CompileFunction(Function* function, JITTargetAddress arg) {
         outs() << "\n";
     }
 
-    sym = ES.lookup({DYLIB}, (*MANGLE)(mangled));
-    if (!sym) {
-        errs() << "Failed to specialize function " << function->getName() << " for argument " << arg << "\n";
-        return 0;
+    if (!result) {
+        errs() << "Failed to specialize function " << mangled[0] << "\n";
+        ES.reportError(result.takeError());
+        return addrs;
     }
-    return sym->getAddress();
+    for (size_t i = 0; i < syms.size(); i ++) addrs[i] = (*result)[syms[i]].getAddress();
+    return addrs;
 }
 
-// Specializes the provided function on a particular argument.
-JITTargetAddress SpecializationPass::arg;
+static JITTargetAddress LinkSpecialization(const std::string& mangled, ThreadSafeModule tsm) {
+    return LinkSpecializations(mangled, std::move(tsm))[0];
+}
 
-SpecializationPass::SpecializationPass(): FunctionPass(pid) {}
+// Creates the module for a specialized function at a given tier. The module identifier keys the
+// object cache, so besides the function's name it records everything else that changes the compiled
+// code: the tier, and whether the code is counted for a -code-budget or -stats. Must hold the context lock.
+static ThreadSafeModule CreateSpecializedModule(const std::string& mangled, unsigned tier, bool counted) {
+    std::string name = mangled;
+    if (counted) name += ".counted";
+    if (stats_enabled) name += ".stats";
+    if (tier != 1) name += ".t" + to_string(tier) + (tier == 2 && IsDebugFlag("-O3") ? "o3" : "");
+    ThreadSafeModule tsm(std::make_unique<Module>(name, *CTX.getContext()), CTX);
+    tsm.getModuleUnlocked()->addModuleFlag(Module::Warning, TIER_MD, tier);
+    DeclareInternalFunctions(*CTX.getContext(), tsm.getModuleUnlocked());
+    return tsm;
+}
+
+// Counts calls into a specialization against the profile of the function it came from, for -stats.
+// The counter is linked in by name, so cached objects stay valid across runs. Must hold the context
+// lock.
+static void AddStatsCounter(Function* copy, StringRef function) {
+    Module* module = copy->getParent();
+    Type* i64 = Type::getInt64Ty(copy->getContext());
+    GlobalVariable* counter = module->getNamedGlobal((function + ".stats").str());
+    if (!counter) counter = new GlobalVariable(*module, i64, false, GlobalValue::ExternalLinkage, nullptr, function + ".stats");
+    IRBuilder<> builder(&*copy->getEntryBlock().getFirstInsertionPt());
+    LoadInst* load = builder.CreateLoad(i64, counter);
+    load->setAtomic(AtomicOrdering::Monotonic);
+    load->setAlignment(Align(8));
+    StoreInst* store = builder.CreateStore(builder.CreateAdd(load, builder.getInt64(1)), counter);
+    store->setAtomic(AtomicOrdering::Monotonic);
+    store->setAlignment(Align(8));
+}
+
+// Adds the compile time and code size of specializations compiled together to the profiles of the
+// functions they came from, for -stats. Members of a batch share both equally.
+static void RecordCompileStats(ArrayRef<pair<Function*, JITTargetAddress>> targets, ArrayRef<string> mangled,
+    ArrayRef<JITTargetAddress> addrs, chrono::steady_clock::time_point start) {
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    uint64_t bytes = 0;
+    {
+        lock_guard<mutex> lock(code_lock);
+        for (const string& name : mangled) {
+            auto it = loading_sizes.find(name);
+            if (it == loading_sizes.end()) continue;
+            bytes = max(bytes, it->second);
+            loading_sizes.erase(it);
+        }
+    }
+    for (size_t i = 0; i < targets.size(); i ++) {
+        FunctionProfile* profile = FindProfile(targets[i].first->getName());
+        if (!profile) continue;
+        profile->compile_ns += ns / targets.size();
+        if (!addrs[i]) continue;
+        profile->specializations ++;
+        profile->code_bytes += bytes / targets.size();
+    }
+}
+
+// Compiles functions specialized on particular inputs together in one module, optimized at the given
+// tier. Returns their addresses, in order, with 0 for any that failed.
+SmallVector<JITTargetAddress, 8> CompileFunctions(ArrayRef<std::pair<Function*, JITTargetAddress>> targets, unsigned tier) {
+    auto start = chrono::steady_clock::now();
+    SmallVector<std::string, 8> mangled;
+    for (auto& target : targets) mangled.push_back(SpecializedName(target.first, target.second));
+    if (stats_enabled) {
+        lock_guard<mutex> lock(code_lock);
+        for (const string& name : mangled) loading_sizes[name] = 0;
+    }
+    // With a code budget, each specialization needs counters for eviction to go by.
+    SmallVector<Specialization*, 8> specs(targets.size(), nullptr);
+    if (code_budget) {
+        lock_guard<mutex> lock(code_lock);
+        for (size_t i = 0; i < targets.size(); i ++) {
+            if (code_symbols.find(mangled[i]) != code_symbols.end()) continue;
+            specs[i] = new Specialization;
+            specs[i]->symbol = mangled[i];
+            code_symbols[mangled[i]] = specs[i];
+        }
+    }
+    ThreadSafeModule tsm;
+    {
+        // The source module shares its context with the module lazily compiled functions are
+        // extracted from, which may be in use on another thread.
+        auto lock = CTX.getLock();
+        std::string name = mangled[0];
+        for (size_t i = 1; i < mangled.size(); i ++) name += "+" + mangled[i];
+        tsm = CreateSpecializedModule(name, tier, any_of(specs.begin(), specs.end(), [](Specialization* spec) { return spec; }));
+        
+        for (size_t i = 0; i < targets.size(); i ++) {
+            SmallVector<ReturnInst*, 8> returns;
+            Function* copy = CloneIntoModule(tsm.getModuleUnlocked(), targets[i].first, mangled[i], returns);
+
+            // Record the key on the clone, for SpecializationPass to fold in.
+            LLVMContext& ctx = copy->getContext();
+            copy->setMetadata(SPECIALIZATION_MD, MDNode::get(ctx, ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(ctx), targets[i].second))));
+            if (stats_enabled) AddStatsCounter(copy, targets[i].first->getName());
+
+            if (specs[i]) {
+                // Count the call on entry, and mark it running until it returns. The counters live in
+                // the runtime and are linked in by name, so cached objects stay valid across runs.
+                Type* i64 = Type::getInt64Ty(ctx);
+                ArrayType* countert = ArrayType::get(i64, 2);
+                GlobalVariable* counters = new GlobalVariable(*tsm.getModuleUnlocked(), countert, false,
+                    GlobalValue::ExternalLinkage, nullptr, mangled[i] + ".counters");
+                IRBuilder<> builder(&*copy->getEntryBlock().getFirstInsertionPt());
+                Value* hits = builder.CreateConstInBoundsGEP2_64(countert, counters, 0, 0);
+                Value* active = builder.CreateConstInBoundsGEP2_64(countert, counters, 0, 1);
+                LoadInst* load = builder.CreateLoad(i64, hits);
+                load->setAtomic(AtomicOrdering::Monotonic);
+                load->setAlignment(Align(8));
+                StoreInst* store = builder.CreateStore(builder.CreateAdd(load, builder.getInt64(1)), hits);
+                store->setAtomic(AtomicOrdering::Monotonic);
+                store->setAlignment(Align(8));
+                builder.CreateAtomicRMW(AtomicRMWInst::Add, active, builder.getInt64(1), AtomicOrdering::Monotonic);
+                for (ReturnInst* ret : returns) {
+                    builder.SetInsertPoint(ret);
+                    builder.CreateAtomicRMW(AtomicRMWInst::Sub, active, builder.getInt64(1), AtomicOrdering::Release);
+                }
+            }
+        }
+        tsm = DetachSpecializedModule(std::move(tsm));
+    }
+
+    SymbolMap counters;
+    for (size_t i = 0; i < targets.size(); i ++)
+        if (specs[i]) counters[(*MANGLE)(mangled[i] + ".counters")] = JITEvaluatedSymbol(pointerToJITTargetAddress(specs[i]->counters), JITSymbolFlags::Exported);
+    if (!counters.empty()) {
+        if (Error err = DYLIB->define(absoluteSymbols(std::move(counters)))) {
+            DYLIB->getExecutionSession().reportError(std::move(err));
+            // nothing was defined, so later compiles must not find these specializations
+            lock_guard<mutex> lock(code_lock);
+            for (size_t i = 0; i < targets.size(); i ++) {
+                if (!specs[i]) continue;
+                code_symbols.erase(mangled[i]);
+                delete specs[i];
+            }
+            return SmallVector<JITTargetAddress, 8>(targets.size(), 0);
+        }
+    }
+
+    SmallVector<JITTargetAddress, 8> addrs = LinkSpecializations(mangled, std::move(tsm));
+    RecordSpecializations(tier, count_if(addrs.begin(), addrs.end(), [](JITTargetAddress addr) { return addr; }));
+    if (stats_enabled) RecordCompileStats(targets, mangled, addrs, start);
+    lock_guard<mutex> lock(code_lock);
+    for (size_t i = 0; i < targets.size(); i ++) {
+        if (addrs[i] || !specs[i]) continue;
+        code_symbols.erase(mangled[i]);
+        delete specs[i];
+    }
+    return addrs;
+}
+
+// Compiles a function specialized on a particular input, optimized at the given tier.
+JITTargetAddress CompileFunction(Function* function, JITTargetAddress arg, unsigned tier) {
+    return CompileFunctions({ { function, arg } }, tier)[0];
+}
+
+// Returns the name of a function's version guarded on the given facts. The facts are spelled out in
+// the name, which is also the module identifier the object cache keys on.
+static string GuardedName(Function* function, ArrayRef<ArgFacts> facts) {
+    string name = function->getName().str() + "_guard";
+    for (const ArgFacts& f : facts) {
+        name += "_" + to_string(f.idx);
+        if (f.ranged()) name += "r" + to_string((uint64_t)f.min) + "." + to_string((uint64_t)f.max);
+        else if (f.nonnegative()) name += "n";
+        if (f.alignment()) name += "a" + to_string(f.alignment());
+        if (f.pow2) name += "p";
+    }
+    return name;
+}
+
+// Compiles a version of a function that checks the given facts on entry, and calls the generic
+// version if any of them fail. Past the check, the facts are stated with llvm.assume, so that the
+// optimizer can use them throughout the body.
+static JITTargetAddress CompileGuarded(Function* function, ArrayRef<ArgFacts> facts, const string& name, unsigned tier) {
+    auto start = chrono::steady_clock::now();
+    if (stats_enabled) {
+        lock_guard<mutex> lock(code_lock);
+        loading_sizes[name] = 0;
+    }
+    ThreadSafeModule tsm;
+    {
+        auto lock = CTX.getLock();
+        tsm = CreateSpecializedModule(name, tier, false);
+        Module* module = tsm.getModuleUnlocked();
+        SmallVector<ReturnInst*, 8> returns;
+        Function* copy = CloneIntoModule(module, function, name, returns);
+        if (stats_enabled) AddStatsCounter(copy, function->getName());
+        Function* generic = cast<Function>(module->getOrInsertFunction(function->getName(), function->getFunctionType()).getCallee());
+
+        // Check the facts at the end of the entry block, after its allocas, which must stay in the
+        // entry block to be promoted.
+        BasicBlock* entry = &copy->getEntryBlock();
+        BasicBlock::iterator split = entry->getFirstInsertionPt();
+        while (isa<AllocaInst>(&*split)) ++ split;
+        BasicBlock* body = entry->splitBasicBlock(split, "guarded");
+        entry->getTerminator()->eraseFromParent();
+        IRBuilder<> builder(entry);
+        SmallVector<Value*, 8> conds;
+        for (const ArgFacts& f : facts) {
+            Argument* arg = copy->getArg(f.idx);
+            Type* argt = arg->getType();
+            if (f.ranged()) {
+                conds.push_back(builder.CreateICmpSGE(arg, ConstantInt::get(argt, f.min, true)));
+                conds.push_back(builder.CreateICmpSLE(arg, ConstantInt::get(argt, f.max, true)));
+            }
+            else if (f.nonnegative()) conds.push_back(builder.CreateICmpSGE(arg, ConstantInt::get(argt, 0)));
+            if (f.alignment()) {
+                Value* low = builder.CreateAnd(arg, ConstantInt::get(argt, (1ul << f.alignment()) - 1));
+                conds.push_back(builder.CreateICmpEQ(low, ConstantInt::get(argt, 0)));
+            }
+            if (f.pow2) {
+                conds.push_back(builder.CreateICmpNE(arg, ConstantInt::get(argt, 0)));
+                Value* rest = builder.CreateAnd(arg, builder.CreateSub(arg, ConstantInt::get(argt, 1)));
+                conds.push_back(builder.CreateICmpEQ(rest, ConstantInt::get(argt, 0)));
+            }
+        }
+        Value* pass = builder.getTrue();
+        for (Value* cond : conds) pass = builder.CreateAnd(pass, cond);
+        BasicBlock* fallback = BasicBlock::Create(copy->getContext(), "fallback", copy);
+        builder.CreateCondBr(pass, body, fallback);
+
+        builder.SetInsertPoint(fallback);
+        SmallVector<Value*, 8> args;
+        for (Argument& arg : copy->args()) args.push_back(&arg);
+        CallInst* call = builder.CreateCall(generic, args);
+        call->setTailCall();
+        if (copy->getReturnType()->isVoidTy()) builder.CreateRetVoid();
+        else builder.CreateRet(call);
+
+        builder.SetInsertPoint(&*body->getFirstInsertionPt());
+        for (Value* cond : conds) builder.CreateAssumption(cond);
+        tsm = DetachSpecializedModule(std::move(tsm));
+    }
+    JITTargetAddress addr = LinkSpecialization(name, std::move(tsm));
+    if (addr) RecordSpecializations(tier, 1);
+    if (stats_enabled) RecordCompileStats({ { function, 0 } }, name, addr, start);
+    return addr;
+}
+
+// Compiles a version of a megamorphic function guarded on the facts its arguments have had in common,
+// and points the call sites falling back to the generic function at it instead. The function's
+// argument table is only retired by this thread, so it is still intact while the function is megamorphic.
+static void SpecializeGuarded(FunctionProfile* profile, Function* function) {
+    if (!profile->megamorphic.load(memory_order_acquire)) return;
+    SmallVector<ArgFacts, 4> facts = FindArgFacts(function, profile->args.load(memory_order_acquire));
+    if (facts.empty()) return;
+    string name = GuardedName(function, facts);
+    auto it = profile->guards.find(name);
+    JITTargetAddress addr = it == profile->guards.end() ? CompileGuarded(function, facts, name, ChooseTier(profile)) : it->second;
+    if (!addr) return;
+    profile->guards[name] = addr;
 
-void SpecializationPass::setValue(llvm::JITTargetAddress arg_in) {
-    arg = arg_in;
+    lock_guard<mutex> lock(ic_lock);
+    profile->guarded = addr;
+    if (!profile->megamorphic.load(memory_order_relaxed)) return;
+    for (uint64_t* site : profile->sites)
+        __atomic_store_n(site + 2 * INLINE_CACHE_SIZE, addr, __ATOMIC_RELAXED);
 }
 
+// Returns true if a value live into a loop is passed to the loop's continuation by value. Allocas that
+// can be promoted are, so that both sides can still keep them in registers; others are passed by address,
+// and the continuation works on the generic function's frame.
+static bool passedByValue(Value* v) {
+    AllocaInst* alloca = dyn_cast<AllocaInst>(v);
+    return alloca && isAllocaPromotable(alloca);
+}
+
+// Collects the values live into a loop header, which a continuation from the loop takes as parameters:
+// the arguments, values defined in blocks that strictly dominate the header, and the header's phis that
+// are used on some path from the header. A use by a phi is on the path if the edge it comes in on is.
+// Returns false if the loop cannot be entered mid-way.
+static bool findLiveIns(Function& f, BasicBlock* header, DominatorTree& DT, SmallVectorImpl<Value*>& live) {
+    if (f.isVarArg() || f.callsFunctionThatReturnsTwice() || header->isEHPad()) return false;
+    SmallPtrSet<BasicBlock*, 32> reachable;
+    SmallVector<BasicBlock*, 32> worklist = { header };
+    while (!worklist.empty()) {
+        BasicBlock* bb = worklist.pop_back_val();
+        if (!reachable.insert(bb).second) continue;
+        for (BasicBlock* succ : successors(bb)) worklist.push_back(succ);
+    }
+    auto used = [&](Value* v) {
+        return any_of(v->uses(), [&](Use& use) {
+            Instruction* user = dyn_cast<Instruction>(use.getUser());
+            if (!user) return false;
+            PHINode* phi = dyn_cast<PHINode>(user);
+            return reachable.count(phi ? phi->getIncomingBlock(use) : user->getParent()) > 0;
+        });
+    };
+    for (Argument& arg : f.args())
+        if (used(&arg)) live.push_back(&arg);
+    for (BasicBlock& bb : f) {
+        if (&bb == header) {
+            for (PHINode& phi : bb.phis())
+                if (used(&phi)) live.push_back(&phi);
+            continue;
+        }
+        if (!DT.properlyDominates(&bb, header)) continue;
+        for (Instruction& inst : bb) {
+            if (!used(&inst)) continue;
+            // only static allocas can be recreated in the continuation's entry block
+            AllocaInst* alloca = dyn_cast<AllocaInst>(&inst);
+            if (inst.getType()->isTokenTy() || (alloca && (&bb != &f.getEntryBlock() || !alloca->isStaticAlloca()))) return false;
+            live.push_back(&inst);
+        }
+    }
+    return true;
+}
+
+// Returns the type of a function's continuation from a loop with the given live values.
+static FunctionType* continuationType(Function& f, ArrayRef<Value*> live) {
+    SmallVector<Type*, 8> params;
+    for (Value* v : live) params.push_back(passedByValue(v) ? cast<AllocaInst>(v)->getAllocatedType() : v->getType());
+    return FunctionType::get(f.getReturnType(), params, false);
+}
+
+// Builds the continuation of a source function from one of its loops: a copy of the function that is
+// entered at the loop header, with the values live into the header as parameters. Values defined again
+// on the way round an outer loop are merged with the parameters. Returns null if the loop cannot be
+// entered mid-way. Must hold the source context's lock.
+static Function* BuildContinuation(Module* module, Function* function, unsigned loop, StringRef name) {
+    LoadSourceBody(function);
+    if (function->isDeclaration()) return nullptr;
+    DominatorTree DT(*function);
+    LoopInfo LI(DT);
+    SmallVector<Loop*, 8> loops = LI.getLoopsInPreorder();
+    SmallVector<Value*, 8> live;
+    if (loop >= loops.size() || !findLiveIns(*function, loops[loop]->getHeader(), DT, live)) return nullptr;
+
+    Function* cont = Function::Create(continuationType(*function, live), Function::ExternalLinkage, name, module);
+    ValueToValueMapTy vmap;
+    for (Argument& arg : function->args()) vmap[&arg] = UndefValue::get(arg.getType());
+    for (size_t i = 0; i < live.size(); i ++)
+        if (isa<Argument>(live[i])) vmap[live[i]] = cont->getArg(i);
+    SmallVector<ReturnInst*, 8> returns;
+    SourceGlobalMaterializer materializer(module);
+    CloneFunctionInto(cont, function, vmap, true, returns, "", nullptr, nullptr, &materializer);
+    TagIndirectCalls(function, vmap);
+    AllowOptimization(cont);
+
+    BasicBlock* header = cast<BasicBlock>(vmap[loops[loop]->getHeader()]);
+    BasicBlock* entry = BasicBlock::Create(cont->getContext(), "osr.entry", cont, &cont->getEntryBlock());
+    IRBuilder<> builder(entry);
+    SmallVector<pair<Instruction*, Value*>, 8> defs;
+    for (size_t i = 0; i < live.size(); i ++) {
+        if (isa<Argument>(live[i])) continue;
+        Value* value = cont->getArg(i);
+        if (passedByValue(live[i])) {
+            AllocaInst* original = cast<AllocaInst>(live[i]);
+            AllocaInst* local = builder.CreateAlloca(original->getAllocatedType(), nullptr, original->getName());
+            local->setAlignment(original->getAlign());
+            builder.CreateStore(value, local);
+            value = local;
+        }
+        Instruction* copy = cast<Instruction>(vmap[live[i]]);
+        if (copy->getParent() == header) cast<PHINode>(copy)->addIncoming(value, entry);
+        else defs.push_back({ copy, value });
+    }
+    builder.CreateBr(header);
+
+    // Definitions the continuation can no longer reach are simply replaced. The others need merging.
+    SmallPtrSet<BasicBlock*, 32> reachable;
+    for (BasicBlock* bb : depth_first(entry)) reachable.insert(bb);
+    SmallVector<pair<Instruction*, Value*>, 8> merged;
+    for (auto& def : defs) {
+        if (reachable.count(def.first->getParent())) merged.push_back(def);
+        else def.first->replaceAllUsesWith(def.second);
+    }
+    EliminateUnreachableBlocks(*cont);
+    for (auto& def : merged) {
+        Instruction* copy = def.first;
+        SSAUpdater ssa;
+        ssa.Initialize(copy->getType(), copy->getName());
+        ssa.AddAvailableValue(entry, def.second);
+        ssa.AddAvailableValue(copy->getParent(), copy);
+        for (Use& use : make_early_inc_range(copy->uses())) {
+            Instruction* user = cast<Instruction>(use.getUser());
+            // uses in the defining block below the definition already see it
+            if (user->getParent() == copy->getParent() && !isa<PHINode>(user)) continue;
+            ssa.RewriteUse(use);
+        }
+    }
+    return cont;
+}
+
+// Compiles the continuation of a function from one of its loops. Returns its address, or 0 if the loop
+// cannot be entered mid-way or the compile failed.
+static JITTargetAddress CompileContinuation(Function* function, unsigned loop, unsigned tier) {
+    auto start = chrono::steady_clock::now();
+    string name = function->getName().str() + ".osr" + to_string(loop);
+    ThreadSafeModule tsm;
+    {
+        auto lock = CTX.getLock();
+        tsm = CreateSpecializedModule(name, tier, false);
+        Function* cont = BuildContinuation(tsm.getModuleUnlocked(), function, loop, name);
+        if (!cont) return 0;
+        if (stats_enabled) AddStatsCounter(cont, function->getName());
+        tsm = DetachSpecializedModule(std::move(tsm));
+    }
+    if (stats_enabled) {
+        lock_guard<mutex> lock(code_lock);
+        loading_sizes[name] = 0;
+    }
+    JITTargetAddress addr = LinkSpecialization(name, std::move(tsm));
+    if (addr) RecordSpecializations(tier, 1);
+    if (stats_enabled) RecordCompileStats({ { function, 0 } }, name, addr, start);
+    return addr;
+}
+
+// Compiles a loop's continuation, and publishes it in the loop's slots for the loop to jump into. The
+// loop may have asked twice if threads raced on its count.
+static void SpecializeOSR(const CompileRequest& req) {
+    if (__atomic_load_n(req.osr + 1, __ATOMIC_ACQUIRE)) return;
+    JITTargetAddress addr = CompileContinuation(req.function, req.loop, req.tier);
+    if (addr) __atomic_store_n(req.osr + 1, addr, __ATOMIC_RELEASE);
+}
+
+// Specializes the provided function on the key recorded in its metadata.
+SpecializationPass::SpecializationPass(): FunctionPass(pid) {}
+
 bool SpecializationPass::runOnFunction(Function &f) {
-    if (f.arg_begin() == f.arg_end()) return true;
+    MDNode* md = f.getMetadata(SPECIALIZATION_MD);
+    if (!md) return false;
+    uint64_t arg = mdconst::extract<ConstantInt>(md->getOperand(0))->getZExtValue();
 
-    Value* fnarg = nullptr;
-    fnarg = dyn_cast<Value>(f.arg_begin());
-    ConstantInt* const_val = llvm::ConstantInt::get(f.getContext(), llvm::APInt(fnarg->getType()->getScalarSizeInBits(), arg, false));
-    fnarg->replaceAllUsesWith(const_val);
+    // Unpack each specialized parameter from the key, in the order they were packed. Pointers become
+    // constant addresses, which ImmutableLoadPass can fold loads through.
+    unsigned offset = 0;
+    for (unsigned idx : findSpecializedArgs(&f)) {
+        Argument* fnarg = f.getArg(idx);
+        Type* argt = fnarg->getType();
+        unsigned bits = keyBits(argt);
+        Constant* const_val = llvm::ConstantInt::get(f.getContext(), llvm::APInt(bits, arg >> offset, false));
+        if (argt->isPointerTy()) const_val = ConstantExpr::getIntToPtr(const_val, argt);
+        else if (argt->isFloatingPointTy()) const_val = ConstantExpr::getBitCast(const_val, argt);
+        fnarg->replaceAllUsesWith(const_val);
+        offset += bits;
+    }
 
     if (IsDebugFlag("-log-spec")) {
         outs() << "Specialized function " << f.getName() << " on argument " << arg << "\n";
@@ -265,42 +2178,431 @@ bool SpecializationPass::runOnFunction(Function &f) {
     return true;
 }
 
+ImmutableLoadPass::ImmutableLoadPass(): FunctionPass(pid) {}
+
+bool ImmutableLoadPass::runOnFunction(Function &f) {
+    return foldImmutableLoads(f);
+}
+
 // Inserts trampolines into functions. Transforms all function calls to active module functions
 // into indirect calls, using the JITResolveCall function to resolve the address prior to invocation.
+// Each call site gets an inline cache of INLINE_CACHE_SIZE (argument, address) slots that is checked
+// before falling back to JITResolveCall, so calls that hit a cached specialization skip the runtime.
 InstrumentationPass::InstrumentationPass(): FunctionPass(pid) {}
 
 bool InstrumentationPass::doInitialization(Module &m) {
     resolveFn = m.getFunction("JITResolveCall");
+    memoizeFn = m.getFunction("JITMemoize");
+    osrFn = m.getFunction("JITRequestOSR");
+    profileFn = m.getFunction("JITProfileTarget");
     return resolveFn;
 }
 
+// Decides whether a function is pure enough for its calls to be answered from memory: its result is an
+// integer, its parameters are all part of the key (integers and floating-point values, packed as their
+// bits), and LLVM's function attribute inference finds that it does not access memory, which rules out writes and calls to anything not
+// known to be pure. Calls to itself are followed. Other calls are not, so they make it impure unless
+// LLVM knows they do not access memory, as for most intrinsics. The answer is kept in the profile,
+// along with a memo table if pure. Functions taking pointers are never memoized: a pointer key stands
+// for an address, not for what is there, which may change between calls. Must hold the source context's lock.
+static bool IsPure(FunctionProfile* profile) {
+    int purity = profile->purity.load(memory_order_acquire);
+    if (purity != PURITY_UNKNOWN) return purity == PURITY_PURE;
+    Function* function = profile->function;
+    Type* rett = function ? function->getReturnType() : nullptr;
+    bool pure = function && HasSourceBody(function) && !function->isVarArg()
+        && rett->isIntegerTy() && rett->getIntegerBitWidth() <= 64
+        && findSpecializedArgs(function).size() == function->arg_size()
+        && none_of(function->args(), [](Argument& arg) { return arg.getType()->isPointerTy(); });
+    if (pure) {
+        // Analyze a copy under the same name, so that recursive calls are calls to the copy. Unoptimized
+        // bitcode keeps locals in memory, so they are promoted first.
+        Module scratch("jiujitsu.purity", function->getContext());
+        SmallVector<ReturnInst*, 8> returns;
+        Function* copy = CloneIntoModule(&scratch, function, function->getName(), returns);
+        legacy::PassManager PM;
+        PM.add(createPromoteMemoryToRegisterPass());
+        PM.add(createPostOrderFunctionAttrsLegacyPass());
+        PM.run(scratch);
+        pure = copy->doesNotAccessMemory();
+    }
+    if (pure) profile->memo = new concurrent_intmap;
+    profile->purity.store(pure ? PURITY_PURE : PURITY_IMPURE, memory_order_release);
+    return pure;
+}
+
+// Decides how many calls with the same argument a function needs before it is specialized on it, by
+// weighing what specializing would save on each call against what it would cost to compile. The
+// savings are estimated from the function's IR once its locals are promoted: an instruction for every
+// use of a value computed from the specialized parameters alone, BRANCH_BENEFIT for every branch on
+// one, and LOOP_BENEFIT for every instruction of a loop that exits on a comparison with one, whose
+// trip count is then known. The cost is COMPILE_COST for every instruction. A small leaf function that
+// does little but compute on its arguments comes out at THRESHOLD_MIN, and a large one that barely uses
+// them at THRESHOLD_MAX, which is below any code address, so counts never look like specializations.
+// -threshold sets every function's threshold instead.
+// A function's threshold is decided when its generic version is compiled, from the body being
+// instrumented, and kept in its profile. The body has to be loaded, and its context locked.
+static uint64_t ChooseThreshold(FunctionProfile* profile, Function* body) {
+    uint64_t threshold = profile->threshold.load(memory_order_acquire);
+    if (threshold) return threshold;
+    if (threshold_override) threshold = threshold_override;
+    else if (body->isDeclaration() || findSpecializedArgs(body).empty()) threshold = SPECIALIZATION_THRESHOLD;
+    else {
+        // Analyze a copy, with its locals promoted the way tier 1 promotes them, so that uses of the
+        // parameters are not hidden behind the stack slots unoptimized bitcode keeps them in.
+        ValueToValueMapTy vmap;
+        Function* copy = CloneFunction(body, vmap);
+        DominatorTree DT(*copy);
+        std::vector<AllocaInst*> allocas;
+        for (Instruction& inst : copy->getEntryBlock())
+            if (AllocaInst* alloca = dyn_cast<AllocaInst>(&inst))
+                if (isAllocaPromotable(alloca)) allocas.push_back(alloca);
+        if (!allocas.empty()) PromoteMemToReg(allocas, DT);
+
+        // Values computed from the specialized parameters alone fold to constants once they are
+        // specialized, and so do the instructions using them, as far as they do not touch memory.
+        SmallPtrSet<Value*, 32> known;
+        SmallVector<Value*, 32> worklist;
+        for (unsigned idx : findSpecializedArgs(copy)) {
+            known.insert(copy->getArg(idx));
+            worklist.push_back(copy->getArg(idx));
+        }
+        SmallPtrSet<Instruction*, 32> uses;
+        while (!worklist.empty()) {
+            Value* v = worklist.pop_back_val();
+            for (User* user : v->users()) {
+                Instruction* inst = dyn_cast<Instruction>(user);
+                if (!inst) continue;
+                uses.insert(inst);
+                if (isa<PHINode>(inst) || isa<CallBase>(inst) || inst->mayReadOrWriteMemory() || inst->isTerminator()) continue;
+                if (!all_of(inst->operands(), [&](Value* op) { return isa<Constant>(op) || known.count(op); })) continue;
+                if (known.insert(inst).second) worklist.push_back(inst);
+            }
+        }
+        uint64_t benefit = uses.size(), size = copy->getInstructionCount();
+        for (Instruction* inst : uses) {
+            if (BranchInst* br = dyn_cast<BranchInst>(inst)) benefit += br->isConditional() && known.count(br->getCondition()) ? BRANCH_BENEFIT : 0;
+            else if (SwitchInst* sw = dyn_cast<SwitchInst>(inst)) benefit += known.count(sw->getCondition()) ? BRANCH_BENEFIT : 0;
+        }
+        LoopInfo LI(DT);
+        for (Loop* loop : LI.getLoopsInPreorder()) {
+            SmallVector<BasicBlock*, 8> exiting;
+            loop->getExitingBlocks(exiting);
+            // the loop exits on a comparison against a known bound, such as i < n
+            bool bounded = any_of(exiting, [&](BasicBlock* bb) {
+                BranchInst* br = dyn_cast<BranchInst>(bb->getTerminator());
+                CmpInst* cmp = br && br->isConditional() ? dyn_cast<CmpInst>(br->getCondition()) : nullptr;
+                return cmp && (known.count(cmp->getOperand(0)) || known.count(cmp->getOperand(1)));
+            });
+            if (!bounded) continue;
+            for (BasicBlock* bb : loop->blocks()) benefit += LOOP_BENEFIT * bb->size();
+        }
+        threshold = benefit ? COMPILE_COST * size / benefit : THRESHOLD_MAX;
+        threshold = max(min(threshold, THRESHOLD_MAX), THRESHOLD_MIN);
+        if (IsDebugFlag("-log-thresholds"))
+            outs() << "Threshold for " << profile->name << ": " << threshold << " (" << size << " instructions, benefit " << benefit << ")\n";
+        copy->eraseFromParent();
+    }
+    // the first decision stands, should two compiles make one
+    uint64_t expected = 0;
+    if (!profile->threshold.compare_exchange_strong(expected, threshold, memory_order_acq_rel)) return expected;
+    return threshold;
+}
+
+// Packs the values of a call's specialized arguments into a single key, in the layout
+// SpecializationPass unpacks them from.
+static Value* packSpecializedArgs(IRBuilder<>& builder, CallInst* call) {
+    Value* key = builder.getInt64(0);
+    unsigned offset = 0;
+    for (unsigned idx : findSpecializedArgs(call->getCalledFunction())) {
+        Value* arg = call->getArgOperand(idx);
+        unsigned bits = keyBits(arg->getType());
+        if (arg->getType()->isPointerTy()) arg = builder.CreatePtrToInt(arg, builder.getInt64Ty());
+        else if (arg->getType()->isFloatingPointTy()) arg = builder.CreateBitCast(arg, builder.getIntNTy(bits));
+        key = builder.CreateOr(key, builder.CreateShl(builder.CreateZExt(arg, builder.getInt64Ty()), offset));
+        offset += bits;
+    }
+    return key;
+}
+
+// Emits the inline cache guard chain for a call site ahead of the call, and returns a phi in the call's
+// block for the target to call. Each slot is a (key, target) pair, and they are tried in turn: a slot
+// whose key is the argument branches straight to the call with its target, and any other falls
+// through to the next. A slot is empty, or retired by eviction, until the runtime publishes its target,
+// so its target is loaded first and with acquire ordering, and tested before it is called; otherwise a
+// zero argument would match an empty slot. A hit in the first slot is thus a compare, a test and an
+// indirect call. After the slots comes the site's fallback, which is zero, meaning the runtime should be
+// called, unless the callee is megamorphic, in which case it is the generic function. The builder is
+// left in the block calling the runtime, whose result the caller adds to the phi.
+static PHINode* emitInlineCache(IRBuilder<>& builder, Value* site, Value* arg, Instruction* call) {
+    Type* i64 = builder.getInt64Ty();
+    LLVMContext& ctx = builder.getContext();
+    BasicBlock* head = call->getParent();
+    Function* f = head->getParent();
+    BasicBlock* join = head->splitBasicBlock(call->getIterator(), head->getName() + ".ic");
+    head->getTerminator()->eraseFromParent();
+    builder.SetInsertPoint(&join->front());
+    PHINode* chosen = builder.CreatePHI(i64, INLINE_CACHE_SIZE + 2);
+    builder.SetInsertPoint(head);
+    for (unsigned i = 0; i < INLINE_CACHE_SIZE; i ++) {
+        LoadInst* target = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, 2 * i + 1));
+        target->setAtomic(AtomicOrdering::Acquire);
+        target->setAlignment(Align(8));
+        Value* key = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, 2 * i));
+        BasicBlock* hit = BasicBlock::Create(ctx, "ic.hit", f, join);
+        BasicBlock* next = BasicBlock::Create(ctx, "ic.next", f, join);
+        builder.CreateCondBr(builder.CreateICmpEQ(key, arg), hit, next);
+        builder.SetInsertPoint(hit);
+        builder.CreateCondBr(builder.CreateICmpNE(target, builder.getInt64(0)), join, next);
+        chosen->addIncoming(target, hit);
+        builder.SetInsertPoint(next);
+    }
+    LoadInst* fallback = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, 2 * INLINE_CACHE_SIZE));
+    fallback->setAtomic(AtomicOrdering::Monotonic);
+    fallback->setAlignment(Align(8));
+    BasicBlock* miss = BasicBlock::Create(ctx, "ic.miss", f, join);
+    builder.CreateCondBr(builder.CreateICmpEQ(fallback, builder.getInt64(0)), miss, join);
+    chosen->addIncoming(fallback, builder.GetInsertBlock());
+    builder.SetInsertPoint(miss);
+    builder.SetInsertPoint(builder.CreateBr(join));
+    return chosen;
+}
+
 bool InstrumentationPass::runOnFunction(Function &f) {
     LLVMContext& ctx = f.getContext();
+    Module& m = *f.getParent();
+    Type* i64 = Type::getInt64Ty(ctx);
+
+    // Find the loops that can be entered mid-way before anything changes, so that they and their live
+    // values match what BuildContinuation finds in the source module. They are instrumented last, so
+    // that their calls into the runtime are not taken for calls to instrument.
+    struct OSRLoop {
+        unsigned index;
+        BasicBlock* header;
+        SmallVector<Value*, 8> live;
+        FunctionType* type;
+    };
+    std::vector<OSRLoop> osr_loops;
+    auto self = function_ids.find(f.getName().str());
+    // this is the function's first compile, and its body is at hand
+    if (self != function_ids.end()) ChooseThreshold(&profiles[self->second], &f);
+    if (osrFn && !IsDebugFlag("-no-osr") && self != function_ids.end()) {
+        DominatorTree DT(f);
+        LoopInfo LI(DT);
+        SmallVector<Loop*, 8> loops = LI.getLoopsInPreorder();
+        for (unsigned i = 0; i < loops.size(); i ++) {
+            OSRLoop loop = { i, loops[i]->getHeader() };
+            if (!findLiveIns(f, loop.header, DT, loop.live)) continue;
+            loop.type = continuationType(f, loop.live);
+            osr_loops.push_back(loop);
+        }
+    }
+
+    // Number the indirect calls before any are added, in the order TagIndirectCalls numbers them in.
+    std::vector<CallInst*> indirect;
+    if (profileFn && !IsDebugFlag("-no-devirt") && self != function_ids.end())
+        for (auto& bb : f)
+            for (auto& inst : bb)
+                if (isa<CallInst>(&inst) && cast<CallInst>(&inst)->isIndirectCall()) indirect.push_back(cast<CallInst>(&inst));
+
+    // Collect call sites first, since the inline cache splits the blocks they live in.
+    std::vector<CallInst*> calls;
     for (auto& bb : f) {
         for (auto& inst : bb) {
             if (isa<CallInst>(&inst)) {
                 CallInst& call = (CallInst&)inst;
-                int argidx;
                 if (call.getCalledFunction() 
-                    && symbols.find(call.getCalledFunction()->getName().str()) != symbols.end()
-                    && (argidx = findSpecializedArg(call.getCalledFunction())) > -1) {
-                    FunctionType* fnt = call.getCalledFunction()->getFunctionType();
-                    auto it = symbols.find(call.getCalledFunction()->getName().str());
-                    Constant* nameConst = ConstantInt::get(Type::getInt64Ty(ctx), APInt(64, (uint64_t)it->c_str()));
-                    Instruction* str = BitCastInst::Create(Instruction::CastOps::BitCast, nameConst, Type::getInt8PtrTy(ctx));
-                    Instruction* orig = BitCastInst::Create(Instruction::CastOps::SExt, call.getCalledFunction(), Type::getInt64Ty(ctx));
-                    Instruction* arg = BitCastInst::Create(Instruction::CastOps::SExt, call.getArgOperand(argidx), Type::getInt64Ty(ctx));
-                    Instruction* rawchosen = CallInst::Create(resolveFn->getFunctionType(), resolveFn, { orig, arg, str });
-                    Instruction* chosen = BitCastInst::Create(Instruction::CastOps::BitCast, rawchosen, PointerType::get(fnt, 0));
-                    str->insertBefore(&call);
-                    orig->insertBefore(&call);
-                    arg->insertBefore(&call);
-                    rawchosen->insertBefore(&call);
-                    chosen->insertBefore(&call);
-                    call.setCalledFunction(fnt, chosen);
-                }
+                    && function_ids.find(call.getCalledFunction()->getName().str()) != function_ids.end()
+                    && !findSpecializedArgs(call.getCalledFunction()).empty())
+                    calls.push_back(&call);
+            }
+        }
+    }
+
+    // Memoized calls no longer dominate the code after them, so their results are read from the phi
+    // merging them with remembered results instead, loops' live values included.
+    DenseMap<Value*, Value*> memo_results;
+    for (CallInst* call : calls) {
+        Function* callee = call->getCalledFunction();
+        FunctionType* fnt = callee->getFunctionType();
+        IRBuilder<> builder(call);
+        Value* id = builder.getInt64(function_ids.find(callee->getName().str())->second);
+        Value* orig = builder.CreatePtrToInt(callee, i64);
+        Value* arg = packSpecializedArgs(builder, call);
+        bool memo = false;
+        if (IsDebugFlag("-memo") && !IsDebugFlag("-no-ic") && memoizeFn) {
+            auto lock = CTX.getLock();
+            memo = IsPure(&profiles[function_ids.find(callee->getName().str())->second]);
+        }
+        ArrayType* slotst = ArrayType::get(i64, memo ? MEMO_REQUEST + 2 : 2 * INLINE_CACHE_SIZE + 2);
+        GlobalVariable* slots = nullptr;
+        Value* site = nullptr;
+        BasicBlock *answered = nullptr, *done = nullptr;
+        Value* remembered = nullptr;
+        if (!IsDebugFlag("-no-ic")) {
+            // Per-site slots, filled in by the runtime once a specialization exists for an argument,
+            // followed by the target for calls that miss every slot, and the sampling countdown.
+            slots = new GlobalVariable(m, slotst, false, GlobalValue::PrivateLinkage,
+                ConstantAggregateZero::get(slotst), "jit.ic." + callee->getName());
+            site = builder.CreateConstInBoundsGEP2_64(slotst, slots, 0, 0);
+        }
+        if (memo) {
+            // Check the memo slots first, and only make the call if none holds the key. Like the inline
+            // cache, a slot is empty until its flag is set, so the flag is loaded first.
+            Value* hit = builder.getFalse();
+            remembered = builder.getInt64(0);
+            for (int i = MEMO_SLOTS - 1; i >= 0; i --) {
+                LoadInst* filled = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, MEMO_BASE + 3 * i + 2));
+                filled->setAtomic(AtomicOrdering::Acquire);
+                filled->setAlignment(Align(8));
+                Value* key = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, MEMO_BASE + 3 * i));
+                Value* result = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, MEMO_BASE + 3 * i + 1));
+                Value* match = builder.CreateAnd(builder.CreateICmpNE(filled, builder.getInt64(0)), builder.CreateICmpEQ(key, arg));
+                remembered = builder.CreateSelect(match, result, remembered);
+                hit = builder.CreateOr(hit, match);
+            }
+            remembered = builder.CreateTrunc(remembered, call->getType());
+            answered = call->getParent();
+            Instruction* term = SplitBlockAndInsertIfThen(builder.CreateNot(hit), call, false);
+            done = call->getParent();
+            call->moveBefore(term);
+            builder.SetInsertPoint(call);
+        }
+        Value* chosen;
+        if (IsDebugFlag("-no-ic")) {
+            chosen = builder.CreateCall(resolveFn->getFunctionType(), resolveFn,
+                { orig, arg, id, ConstantPointerNull::get(PointerType::get(i64, 0)) });
+        } else {
+            // Only fall back to the runtime when no slot matches and the site has no fallback.
+            PHINode* cached = emitInlineCache(builder, site, arg, call);
+            Instruction* term = &*builder.GetInsertPoint();
+            Value* resolved;
+            if (sample_period) {
+                // Only every sample_period-th miss calls the runtime; the others call the generic function.
+                Value* countdown = builder.CreateConstInBoundsGEP1_64(i64, site, 2 * INLINE_CACHE_SIZE + 1);
+                LoadInst* left = builder.CreateLoad(i64, countdown);
+                left->setAtomic(AtomicOrdering::Monotonic);
+                left->setAlignment(Align(8));
+                Value* sampled = builder.CreateICmpEQ(left, builder.getInt64(0));
+                StoreInst* store = builder.CreateStore(builder.CreateSelect(sampled,
+                    builder.getInt64(sample_period - 1), builder.CreateSub(left, builder.getInt64(1))), countdown);
+                store->setAtomic(AtomicOrdering::Monotonic);
+                store->setAlignment(Align(8));
+                BasicBlock* skipped = term->getParent();
+                Instruction* sample = SplitBlockAndInsertIfThen(sampled, term, false);
+                builder.SetInsertPoint(sample);
+                Value* counted = builder.CreateCall(resolveFn->getFunctionType(), resolveFn, { orig, arg, id, site });
+                builder.SetInsertPoint(term);
+                PHINode* inner = builder.CreatePHI(i64, 2);
+                inner->addIncoming(orig, skipped);
+                inner->addIncoming(counted, sample->getParent());
+                resolved = inner;
             }
+            else resolved = builder.CreateCall(resolveFn->getFunctionType(), resolveFn, { orig, arg, id, site });
+            cached->addIncoming(resolved, term->getParent());
+            builder.SetInsertPoint(call);
+            chosen = cached;
+        }
+        call->setCalledFunction(fnt, builder.CreateIntToPtr(chosen, PointerType::get(fnt, 0)));
+        if (memo) {
+            builder.SetInsertPoint(&done->front());
+            PHINode* result = builder.CreatePHI(call->getType(), 2);
+            call->replaceAllUsesWith(result);
+            memo_results[call] = result;
+
+            // Pass the result to the runtime if it asked the site to remember it for this key.
+            Instruction* next = call->getNextNode();
+            builder.SetInsertPoint(next);
+            LoadInst* requested = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, MEMO_REQUEST));
+            requested->setAtomic(AtomicOrdering::Acquire);
+            requested->setAlignment(Align(8));
+            Value* key = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, MEMO_REQUEST + 1));
+            Value* record = builder.CreateAnd(builder.CreateICmpNE(requested, builder.getInt64(0)), builder.CreateICmpEQ(key, arg));
+            builder.SetInsertPoint(SplitBlockAndInsertIfThen(record, next, false));
+            builder.CreateCall(memoizeFn->getFunctionType(), memoizeFn, { id, arg, builder.CreateZExt(call, i64), site });
+            for (BasicBlock* pred : predecessors(done)) result->addIncoming(pred == answered ? remembered : call, pred);
+        }
+    }
+
+    for (unsigned index = 0; index < indirect.size(); index ++) {
+        CallInst* call = indirect[index];
+        IRBuilder<> builder(call);
+        ArrayType* slotst = ArrayType::get(i64, 2 * VALUE_PROFILE_SLOTS + 1);
+        GlobalVariable* slots = new GlobalVariable(m, slotst, false, GlobalValue::PrivateLinkage,
+            ConstantAggregateZero::get(slotst), "jit.vp." + f.getName());
+        Value* site = builder.CreateConstInBoundsGEP2_64(slotst, slots, 0, 0);
+        Value* target = builder.CreatePtrToInt(call->getCalledOperand(), i64);
+
+        // Count the call against the slot holding its target, or against other targets once every slot
+        // is claimed. Until then, a new target calls into the runtime to claim a slot.
+        Value* counter = builder.CreateConstInBoundsGEP1_64(i64, site, 2 * VALUE_PROFILE_SLOTS);
+        Value* known = nullptr;
+        for (int i = VALUE_PROFILE_SLOTS - 1; i >= 0; i --) {
+            LoadInst* claimed = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, site, 2 * i));
+            claimed->setAtomic(AtomicOrdering::Monotonic);
+            claimed->setAlignment(Align(8));
+            if (!known) known = builder.CreateICmpNE(claimed, builder.getInt64(0));
+            Value* match = builder.CreateICmpEQ(claimed, target);
+            counter = builder.CreateSelect(match, builder.CreateConstInBoundsGEP1_64(i64, site, 2 * i + 1), counter);
+            known = builder.CreateOr(known, match);
         }
+        Instruction *count, *claim;
+        SplitBlockAndInsertIfThenElse(known, call, &count, &claim);
+        builder.SetInsertPoint(count);
+        LoadInst* calls = builder.CreateLoad(i64, counter);
+        calls->setAtomic(AtomicOrdering::Monotonic);
+        calls->setAlignment(Align(8));
+        StoreInst* store = builder.CreateStore(builder.CreateAdd(calls, builder.getInt64(1)), counter);
+        store->setAtomic(AtomicOrdering::Monotonic);
+        store->setAlignment(Align(8));
+        builder.SetInsertPoint(claim);
+        builder.CreateCall(profileFn->getFunctionType(), profileFn, { builder.getInt64(self->second), builder.getInt64(index), target, site });
+    }
+
+    for (OSRLoop& loop : osr_loops) {
+        // The loop's iteration count, and the address of its continuation once compiled.
+        ArrayType* slotst = ArrayType::get(i64, 2);
+        GlobalVariable* slots = new GlobalVariable(m, slotst, false, GlobalValue::PrivateLinkage,
+            ConstantAggregateZero::get(slotst), "jit.osr." + f.getName());
+        BasicBlock* body = loop.header->splitBasicBlock(loop.header->getFirstNonPHI(), "loop");
+        loop.header->getTerminator()->eraseFromParent();
+        BasicBlock* enter = BasicBlock::Create(ctx, "osr.enter", &f, body);
+        BasicBlock* count = BasicBlock::Create(ctx, "osr.count", &f, body);
+        BasicBlock* request = BasicBlock::Create(ctx, "osr.request", &f, body);
+        IRBuilder<> builder(loop.header);
+        Value* counter = builder.CreateConstInBoundsGEP2_64(slotst, slots, 0, 0);
+        LoadInst* cont = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP2_64(slotst, slots, 0, 1));
+        cont->setAtomic(AtomicOrdering::Acquire);
+        cont->setAlignment(Align(8));
+        builder.CreateCondBr(builder.CreateICmpNE(cont, builder.getInt64(0)), enter, count);
+
+        // Jump into the continuation, and return what it returns. It may use this frame's memory, so
+        // the call cannot be a tail call.
+        builder.SetInsertPoint(enter);
+        SmallVector<Value*, 8> args;
+        for (size_t i = 0; i < loop.live.size(); i ++) {
+            Value* v = memo_results.lookup(loop.live[i]);
+            if (!v) v = loop.live[i];
+            Type* paramt = loop.type->getParamType(i);
+            args.push_back(paramt == v->getType() ? v : builder.CreateLoad(paramt, v));
+        }
+        CallInst* result = builder.CreateCall(loop.type, builder.CreateIntToPtr(cont, PointerType::get(loop.type, 0)), args);
+        if (f.getReturnType()->isVoidTy()) builder.CreateRetVoid();
+        else builder.CreateRet(result);
+
+        builder.SetInsertPoint(count);
+        LoadInst* iterations = builder.CreateLoad(i64, counter);
+        iterations->setAtomic(AtomicOrdering::Monotonic);
+        iterations->setAlignment(Align(8));
+        Value* next = builder.CreateAdd(iterations, builder.getInt64(1));
+        StoreInst* store = builder.CreateStore(next, counter);
+        store->setAtomic(AtomicOrdering::Monotonic);
+        store->setAlignment(Align(8));
+        builder.CreateCondBr(builder.CreateICmpEQ(next, builder.getInt64(OSR_THRESHOLD)), request, body);
+
+        builder.SetInsertPoint(request);
+        builder.CreateCall(osrFn->getFunctionType(), osrFn, { builder.getInt64(self->second), builder.getInt64(loop.index), counter });
+        builder.CreateBr(body);
     }
     if (IsDebugFlag("-log-inst")) {
         outs() << "Added instrumentation to function " << f.getName() << "\n";
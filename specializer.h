@@ -1,5 +1,6 @@
 #pragma once
 
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
@@ -21,67 +22,205 @@
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Constants.h>
+#include "codemem.h"
+#include "objcache.h"
 
 #define SPECIALIZATION_THRESHOLD 100LU
+#define THRESHOLD_MIN 4LU
+#define THRESHOLD_MAX 65535LU
+#define COMPILE_COST 8LU
+#define BRANCH_BENEFIT 4LU
+#define LOOP_BENEFIT 4LU
+#define COMPILE_QUEUE_DEPTH 64LU
+#define INLINE_CACHE_SIZE 2LU
+#define COUNT_SHARDS 64LU
+#define COUNT_BATCH 8LU
+#define MEGAMORPHIC_LIMIT 256LU
+#define REPROFILE_DELAY_MS 100LU
+#define REPROFILE_MAX_DELAY_MS 60000LU
+#define GUARD_RANGE_LIMIT 65536LU
+#define TRANSITIVE_DEPTH 16LU
+#define TRANSITIVE_LIMIT 64LU
+#define SPECIALIZATION_MD "jiujitsu.spec"
+#define TIER_MD "jiujitsu.tier"
+#define SITE_MD "jiujitsu.site"
+#define TIER_COUNT 3LU
+#define TIER2_CALLS 10000LU
+#define BATCH_SIZE 16LU
+#define BATCH_WINDOW_MS 2LU
+#define STATS_POLL_MS 100LU
+#define SOURCE_BODIES 256LU
+#define MEMO_SLOTS 2LU
+#define MEMO_LIMIT 4096LU
+#define OSR_THRESHOLD 10000LU
+#define VALUE_PROFILE_SLOTS 4LU
+#define DEVIRT_TARGETS 2LU
+#define DEVIRT_PERCENT 25LU
 
 void AddDebugFlag(llvm::StringRef str);
 bool IsDebugFlag(llvm::StringRef str);
 
+// Flags that take a value. Returns an empty string for flags that were not given.
+void SetFlagValue(llvm::StringRef flag, llvm::StringRef value);
+llvm::StringRef GetFlagValue(llvm::StringRef flag);
+
 // Logs all symbols currently tracked by the specializer.
 void LogSymbols(llvm::raw_ostream& io);
 
 // Registers a symbol with the specializer as a function belonging to an
 // active module. This means that calls to this function will be trampolined
-// in the instrumentation pass.
-void TrackSymbol(llvm::StringRef str);
+// in the instrumentation pass. Returns the function's ID, which instrumented calls pass to
+// JITResolveCall; IDs are dense, and assigned in the order functions are first registered.
+unsigned TrackSymbol(llvm::StringRef str);
 
-// Defines a function for a particular name.
+// Defines a function for a particular name, registering it if it is not already.
 void DefineFunction(llvm::StringRef str, llvm::Function* fn);
 
 llvm::Expected<llvm::orc::ThreadSafeModule> specializeModule(llvm::orc::ThreadSafeModule M, const llvm::orc::MaterializationResponsibility &R);
 
 // Returns the address of the function specialized for the given argument. Has three effects:
 //  1. If the function is specialized on the argument, the count will be an address, numerically
-//     greater than the specialization threshold. Return this address and do not modify the count.
-//  2. If the function is not specialized, but is about to cross the threshold, we specialize the
-//     function with our optimization passes on the input and set the count to the new function's address.
+//     greater than the function's specialization threshold, which is never above THRESHOLD_MAX.
+//     Return this address and do not modify the count.
+//  2. If the function is not specialized, but is about to cross the threshold, we queue a request to
+//     specialize the function on the input and return the normal function address. The count is held at
+//     the threshold while the request is pending, and replaced with the new function's address once the
+//     compile worker finishes.
 //  3. If the function is not specialized, and the count will not exceed the threshold, increment the
-//     count and return the normal function address.
+//     count and return the normal function address. Increments are batched per thread.
+//     With -sample N, call sites only call in for one of every N misses, and each call counts as N.
+//     Calls made before the function is first compiled, which decides its threshold, are not counted.
+// Whenever a specialized address is returned, it is also cached in the calling site's inline cache.
+// With -memo, a site's hot keys for a pure function are remembered in its memo slots rather than
+// specialized, for as long as it has slots left.
+// Functions seeing too many distinct arguments are megamorphic, and are not counted at all until their
+// backoff expires. Profiling only restarts when the compile worker is running, i.e. without -sync-spec.
 // Note that by reusing the count to store the specialized function pointer, we lose the ability to
 // profile functions that are already specialized. However, this allows us to implement all of our
-// lookup tables as simple int-to-int maps, which permits for optimization.
-extern "C" llvm::JITTargetAddress JITResolveCall(llvm::JITTargetAddress fn, llvm::JITTargetAddress arg, const char* name);
+// lookup tables as simple int-to-int maps, which permits for optimization. The tables are lock-free,
+// so guest programs may call this from any number of threads. id is the function's ID from TrackSymbol.
+extern "C" llvm::JITTargetAddress JITResolveCall(llvm::JITTargetAddress fn, llvm::JITTargetAddress arg, uint64_t id, uint64_t* site);
+
+// With -memo, records the result of a call to a pure function from an instrumented call site that the
+// runtime asked to remember it. The result is kept in the function's memo table, of at most MEMO_LIMIT
+// entries, and in the site's own memo slots, so that later calls with the same key skip the call.
+extern "C" void JITMemoize(uint64_t id, uint64_t key, uint64_t result, uint64_t* site);
+
+// Called by a loop in generic code once its header has run OSR_THRESHOLD times. Queues a compile of
+// the function's continuation from the loop, the loop-th in LoopInfo's preorder, at the highest tier.
+// The continuation's address is published in slot[1], where the loop picks it up on its next iteration
+// and jumps into it. slot[0] is the loop's iteration count.
+extern "C" void JITRequestOSR(uint64_t id, uint64_t loop, uint64_t* slot);
+
+// Called by an indirect call site in generic code whose target is not in its value profile while the
+// profile still has room. The profile, site, holds VALUE_PROFILE_SLOTS (target, count) pairs, claimed in
+// order, followed by the count of calls to any other target once all are claimed. index is the site's
+// ordinal among the indirect calls of the function with the given ID, which is how specialized code
+// cloned from the same function finds the profile.
+extern "C" void JITProfileTarget(uint64_t id, uint64_t index, uint64_t target, uint64_t* site);
 
 // Adds JIT implementation functions to a module.
 void DeclareInternalFunctions(llvm::LLVMContext& ctx, llvm::Module* module);
 
-// Sets global source module. This contains LLVM IR before any optimizations are applied.
-void SetSourceModule(llvm::orc::ThreadSafeModule&& tsm);
+// Sets global source module. This contains LLVM IR before any optimizations are applied. It should be
+// loaded lazily from buffer, which is kept so that function bodies can be released and loaded again.
+void SetSourceModule(llvm::orc::ThreadSafeModule&& tsm, std::unique_ptr<llvm::MemoryBuffer> buffer);
 
 // Adds JIT implementation functions to dynamic linker.
 void AddInternalFunctions(llvm::orc::MangleAndInterner& mangle, llvm::orc::SymbolMap& map);
 
-// Initializes specializer with module and other info.
-void InitSpecializer(llvm::orc::JITDylib* dylib, llvm::orc::IRTransformLayer* cl, llvm::orc::ThreadSafeContext ctx);
+// Initializes specializer with module and other info. Starts the background compile worker.
+// If a cache is given, specializations it already holds skip the specialization passes.
+void InitSpecializer(llvm::orc::JITDylib* dylib, llvm::orc::IRTransformLayer* cl, llvm::orc::ThreadSafeContext ctx, SpecializationCache* cache);
+
+// Stops the background compile worker, discarding any requests that have not started compiling,
+// and writes the profile if -profile-out was given. Must be called before the JIT is destroyed.
+void ShutdownSpecializer();
+
+// Writes the argument counts of every tracked function to a file. Returns false on failure.
+bool SaveProfile(llvm::StringRef path);
+
+// Reads a profile written by SaveProfile. Entries that reached the specialization threshold are
+// compiled immediately, so calls to them never go through warm-up; other counts are carried over.
+// lookup returns the address of the generic function for a name, or 0 if it has none.
+bool LoadProfile(llvm::StringRef path, llvm::function_ref<llvm::JITTargetAddress(llvm::StringRef)> lookup);
+
+// Claims the memory of an object defining the given symbol, if it is a specialization being compiled
+// under a -code-budget. Called by CodeMemoryManager for each symbol in every object it loads.
+void TrackCodeMemory(llvm::StringRef symbol, CodeMemoryManager* memory);
 
-// Compiles a function specialized on a particular input.
-llvm::JITTargetAddress CompileFunction(llvm::Function* function, llvm::JITTargetAddress arg);
+// Compiles a function specialized on a particular input, optimized at the given tier.
+llvm::JITTargetAddress CompileFunction(llvm::Function* function, llvm::JITTargetAddress arg, unsigned tier);
 
-// Specializes the provided function on a particular argument.
+// Compiles several specializations at the same tier in one module, with one materialization, so
+// they share the fixed cost of a compile. Returns their addresses, in order, with 0 for any that
+// failed. The worker collects up to BATCH_SIZE requests (-batch to change) for BATCH_WINDOW_MS.
+llvm::SmallVector<llvm::JITTargetAddress, 8> CompileFunctions(llvm::ArrayRef<std::pair<llvm::Function*, llvm::JITTargetAddress>> targets, unsigned tier);
+
+// Code is compiled at one of TIER_COUNT tiers:
+//  0. A minimal pipeline, for generic code compiled on first call.
+//  1. A handful of cheap scalar passes, for specializations of functions with few calls.
+//  2. The full O2 pipeline (O3 with -O3), including inlining, for specializations of functions
+//     with at least TIER2_CALLS calls.
+// Generic code is compiled at the tier given by -base-tier, 0 by default, and specializations at no
+// higher than the tier given by -max-tier. Specialized modules record their tier in a TIER_MD module
+// flag; modules without one are generic.
+unsigned GetBaseTier();
+unsigned GetModuleTier(const llvm::Module& m);
+
+// Compile-time and code-size accounting per tier, logged at exit with -log-tiers.
+void RecordOptimization(unsigned tier, uint64_t ns);
+void RecordCodegen(unsigned tier, uint64_t ns, uint64_t bytes);
+void LogTiers(llvm::raw_ostream& io);
+
+// Returns the indices of the parameters a function is specialized on. Their values are packed
+// into a single 64-bit key, lowest index in the lowest bits, which is what the profiler counts
+// and what SpecializationPass folds back into the function. Integer parameters are preferred;
+// floating-point values, packed as their bits, and pointers, packed as the address they hold, only
+// take the room the integers leave.
+llvm::SmallVector<unsigned, 4> findSpecializedArgs(llvm::Function* fn);
+
+// Specializes functions carrying SPECIALIZATION_MD metadata, replacing every specialized parameter
+// with its value from the key recorded there.
 class SpecializationPass : public llvm::FunctionPass {
   char pid = 74;
-  static llvm::JITTargetAddress arg;
 public:
   SpecializationPass();
-  static void setValue(llvm::JITTargetAddress arg_in);
+  bool runOnFunction(llvm::Function &f) override;
+};
+
+// Folds loads from constant addresses in the read-only data of loaded objects, such as the lookup
+// tables and strings a specialized pointer parameter points into, by reading the values from memory.
+// Modules it folds any loads in are marked UNCACHED_MD, since the same address may hold something
+// else in another run.
+class ImmutableLoadPass : public llvm::FunctionPass {
+  char pid = 77;
+public:
+  ImmutableLoadPass();
   bool runOnFunction(llvm::Function &f) override;
 };
 
 // Inserts trampolines into functions. Transforms all function calls to active module functions
 // into indirect calls, using the JITResolveCall function to resolve the address prior to invocation.
+// Each call site gets an inline cache of INLINE_CACHE_SIZE (argument, address) slots that is checked
+// before falling back to JITResolveCall, so calls that hit a cached specialization skip the runtime.
+// Sites calling a megamorphic function are given a fallback target, and skip the runtime entirely.
+// With -sample N, only one in N misses calls JITResolveCall, and the rest call the generic function.
+// With -memo, sites calling a pure function also get MEMO_SLOTS (key, result) slots, checked before
+// anything else: a call whose key is in one is not made at all.
+// Loop headers also count their iterations, for on-stack replacement: once a loop is hot, the
+// function is continued in optimized code compiled from that loop onwards. The continuation takes
+// the values live into the loop header as parameters, and the generic function returns what it
+// returns. -no-osr turns this off.
+// Indirect calls get a value profile of their targets. Specialized code cloned from the function
+// checks for the hottest of them, and calls them directly, so that they can be specialized and
+// inlined like any other call. -no-devirt turns this off.
 class InstrumentationPass : public llvm::FunctionPass {
     char pid = 76;
     llvm::Function* resolveFn = nullptr;
+    llvm::Function* memoizeFn = nullptr;
+    llvm::Function* osrFn = nullptr;
+    llvm::Function* profileFn = nullptr;
 public:
     InstrumentationPass();
     bool doInitialization(llvm::Module &f) override;
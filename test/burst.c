@@ -0,0 +1,22 @@
+#include "stdio.h"
+
+int digits(int base, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i ++) {
+        int x = i;
+        while (x) {
+            total += x % base;
+            x /= base;
+        }
+    }
+    return total;
+}
+
+// Every base is called in turn, so all 48 of them get hot on the same pass and are queued for
+// specialization together. With batching they are compiled in a few modules instead of 48.
+int main() {
+    long total = 0;
+    for (int i = 0; i < 1000; i ++)
+        for (int base = 2; base < 50; base ++) total += digits(base, 200);
+    printf("%ld\n", total);
+}
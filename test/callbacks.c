@@ -0,0 +1,19 @@
+#include "stdio.h"
+
+int add(int a, int b) { return a + b; }
+int sub(int a, int b) { return a - b; }
+int mix(int a, int b) { return a * 31 + b; }
+
+// Every call from apply is indirect. add and sub take most of them, so specialized code calls them
+// directly, and only calls to mix go through the table.
+int (*ops[])(int, int) = { add, sub, add, sub, add, sub, add, mix };
+
+int apply(int op, int x, int y) {
+    return ops[op](x, y);
+}
+
+int main() {
+    long total = 0;
+    for (int i = 0; i < 1000000; i ++) total += apply(i % 8, i % 100, 7);
+    printf("%ld\n", total);
+}
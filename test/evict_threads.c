@@ -0,0 +1,40 @@
+#include "pthread.h"
+#include "stdio.h"
+
+int digits(int base, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i ++) {
+        int x = i;
+        while (x) {
+            total += x % base;
+            x /= base;
+        }
+    }
+    return total;
+}
+
+// Each thread works through the bases in phases, starting at a different one, so that with a small
+// -code-budget (e.g. 16) specializations are evicted while other threads may still be calling them.
+void* worker(void* arg) {
+    long sum = 0;
+    for (int phase = 0; phase < 8; phase ++) {
+        int first = 2 + (phase * 6 + (long)arg) % 48;
+        for (int i = 0; i < 500; i ++)
+            for (int base = first; base < first + 6; base ++) sum += digits(base, 100);
+    }
+    return (void*)sum;
+}
+
+int main() {
+    pthread_t threads[4];
+    for (long i = 0; i < 4; i ++) {
+        pthread_create(&threads[i], 0, worker, (void*)i);
+    }
+    long total = 0;
+    for (int i = 0; i < 4; i ++) {
+        void* sum;
+        pthread_join(threads[i], &sum);
+        total += (long)sum;
+    }
+    printf("%ld\n", total);
+}
@@ -0,0 +1,14 @@
+#include "stdio.h"
+
+int mix(int x) {
+    return (x * 2654435761u) >> 7;
+}
+
+// The first phase calls mix with a different argument every time, which makes it megamorphic.
+// The second phase has a single hot argument, which it should be specialized on once profiling restarts.
+int main() {
+    long total = 0;
+    for (int i = 0; i < 10000000; i ++) total += mix(i);
+    for (int i = 0; i < 10000000; i ++) total += mix(7);
+    printf("%ld\n", total);
+}
@@ -0,0 +1,12 @@
+#include "stdio.h"
+
+// main runs once, so only on-stack replacement moves it into optimized code.
+int main() {
+    long total = 0;
+    int weights[4] = { 3, 1, 4, 1 };
+    for (int i = 0; i < 20000; i ++) {
+        int scale = i % 7;
+        for (int j = 0; j < 1000; j ++) total += weights[j % 4] * scale;
+    }
+    printf("%ld\n", total);
+}
@@ -0,0 +1,19 @@
+#include "stdio.h"
+
+int scale(int x, int k) {
+    int sum = 0;
+    for (int i = 0; i < k; i ++) sum += x;
+    return sum;
+}
+
+// Each phase makes a new set of arguments hot, so with a small -code-budget
+// the specializations from earlier phases get evicted.
+int main() {
+    long total = 0;
+    for (int phase = 0; phase < 64; phase ++) {
+        for (int i = 0; i < 1000; i ++) {
+            total += scale(phase, 100);
+        }
+    }
+    printf("%ld\n", total);
+}
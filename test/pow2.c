@@ -0,0 +1,16 @@
+#include "stdio.h"
+
+int buckets(unsigned n, unsigned size) {
+    int total = 0;
+    for (unsigned i = 0; i < n; i ++) total += (i * 40503u) % size + i / size;
+    return total;
+}
+
+// Sizes are always powers of two, but too many distinct pairs are seen for any one to get hot.
+// buckets becomes megamorphic, and a version guarded on size being a power of two replaces the
+// division and modulus with shifts and masks.
+int main() {
+    long total = 0;
+    for (int i = 0; i < 2000000; i ++) total += buckets(i % 512, 1u << (i % 12));
+    printf("%ld\n", total);
+}
@@ -0,0 +1,31 @@
+#include "stdio.h"
+
+static const int primes[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+static const int squares[] = { 0, 1, 4, 9, 16, 25, 36, 49, 64, 81, 100, 121, 144, 169, 196, 225 };
+
+// Keyed on the table's address, since there is no integer parameter to prefer. The table lives in
+// read-only data, so specializations fold its entries in.
+int weigh(const int* table) {
+    int total = 0;
+    for (int i = 0; i < 16; i ++) total += table[i] * (1000 % (i + 1));
+    return total;
+}
+
+// Keyed on the bits of x.
+double poly(double x, int n) {
+    double total = 0, term = 1;
+    for (int i = 0; i < n; i ++) {
+        total += term;
+        term *= x;
+    }
+    return total;
+}
+
+int main() {
+    long total = 0;
+    for (int i = 0; i < 100000; i ++) {
+        total += weigh(i % 2 ? primes : squares);
+        total += (long)poly(0.5, 20) + (long)poly(1.5, 20);
+    }
+    printf("%ld\n", total);
+}
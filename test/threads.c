@@ -0,0 +1,29 @@
+#include "pthread.h"
+#include "stdio.h"
+
+int fib(int n) {
+    if (n < 2) return n;
+    return fib(n - 1) + fib(n - 2);
+}
+
+void* worker(void* arg) {
+    long sum = 0;
+    for (int i = 0; i < 1000; i ++) {
+        sum += fib(15 + (long)arg % 2);
+    }
+    return (void*)sum;
+}
+
+int main() {
+    pthread_t threads[8];
+    for (long i = 0; i < 8; i ++) {
+        pthread_create(&threads[i], 0, worker, (void*)i);
+    }
+    long total = 0;
+    for (int i = 0; i < 8; i ++) {
+        void* sum;
+        pthread_join(threads[i], &sum);
+        total += (long)sum;
+    }
+    printf("%ld\n", total);
+}